@@ -0,0 +1,524 @@
+// Microbenchmarks for the server's hot-path pieces.
+//
+// Build: g++ -std=c++17 -O2 bench.cpp -o bench -pthread -lrt
+// Run:   ./bench [--filter TEXT] [--csv FILE] [--baseline FILE]
+//
+// server.cpp is compiled into this binary (without its main) with heap
+// allocation counting on, so every benchmark runs the server's own code.
+// ns/op is wall-clock time divided by the operations completed by all
+// threads; allocs/op counts operator new calls over the same operations.
+// --csv records the results and --baseline compares against a recorded run.
+
+#define CHAT_NO_MAIN
+#define CHAT_COUNT_ALLOCS
+#include "server.cpp"
+
+// ============================================================
+//  HARNESS
+// ============================================================
+
+struct BenchResult
+{
+    std::string name;
+    double ns_per_op = 0;
+    double allocs_per_op = 0;
+    uint64_t ops = 0;
+};
+
+std::vector<BenchResult> bench_results;
+std::string bench_filter;
+
+// Keep the compiler from discarding a value we computed only to time it.
+template <typename T>
+void keep(const T &value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+bool selected(const std::string &name)
+{
+    return bench_filter.empty() || name.find(bench_filter) != std::string::npos;
+}
+
+void report(const std::string &name, std::chrono::steady_clock::duration elapsed, uint64_t ops, uint64_t allocs)
+{
+    BenchResult result;
+    result.name = name;
+    result.ops = ops;
+    result.ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+    result.allocs_per_op = double(allocs) / ops;
+    bench_results.push_back(result);
+    std::printf("%-44s %10.1f ns/op %8.2f allocs/op %12llu ops\n", name.c_str(), result.ns_per_op,
+                result.allocs_per_op, static_cast<unsigned long long>(ops));
+    std::fflush(stdout);
+}
+
+// Time fn(iterations), doubling iterations until one run takes at least
+// 100 ms, and report that run.
+template <typename Fn>
+void bench(const std::string &name, Fn fn)
+{
+    if (!selected(name))
+        return;
+    fn(1000); // warm up caches and pools
+    for (uint64_t iterations = 1000;; iterations *= 2)
+    {
+        uint64_t allocs = allocation_count.load();
+        auto started = std::chrono::steady_clock::now();
+        fn(iterations);
+        auto elapsed = std::chrono::steady_clock::now() - started;
+        if (elapsed >= std::chrono::milliseconds(100) || iterations >= (1ull << 30))
+        {
+            report(name, elapsed, iterations, allocation_count.load() - allocs);
+            return;
+        }
+    }
+}
+
+// Run fn(thread index) on `threads` threads released together, and report
+// ops operations over the time from release to the last thread finishing.
+template <typename Fn>
+void bench_threads(const std::string &name, int threads, uint64_t ops, Fn fn)
+{
+    if (!selected(name))
+        return;
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t)
+        pool.emplace_back([&, t]
+                          {
+            ready++;
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            fn(t); });
+    while (ready.load() < threads)
+        std::this_thread::yield();
+
+    uint64_t allocs = allocation_count.load();
+    auto started = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread &t : pool)
+        t.join();
+    report(name, std::chrono::steady_clock::now() - started, ops, allocation_count.load() - allocs);
+}
+
+// ============================================================
+//  TASK QUEUE
+// ============================================================
+
+// Items moved through one broadcast shard queue. With one thread it pushes
+// and pops in batches; otherwise half the threads produce and half consume.
+void bench_task_queue()
+{
+    for (int threads : {1, 2, 4, 8, 16, 32})
+    {
+        std::string name = "taskqueue/push_pop/threads=" + std::to_string(threads);
+        TaskQueue<BroadcastTask> queue(4096);
+        std::string room = "room1", sender = "alice";
+
+        if (threads == 1)
+        {
+            bench(name, [&](uint64_t iterations)
+                  {
+                std::vector<BroadcastTask> batch;
+                batch.reserve(32);
+                for (uint64_t i = 0; i < iterations; i += 32)
+                {
+                    for (int j = 0; j < 32; ++j)
+                    {
+                        BroadcastTask task;
+                        task.sender_name = sender;
+                        task.target_room = room;
+                        queue.push(std::move(task));
+                    }
+                    batch.clear();
+                    queue.pop_batch(batch, 32);
+                    keep(batch);
+                } });
+            continue;
+        }
+
+        const int producers = threads / 2;
+        const uint64_t per_producer = 2000000 / producers;
+        std::atomic<int> producing{producers};
+        auto push_end = [&queue]()
+        {
+            BroadcastTask end;
+            end.sequence_id = -1;
+            queue.push(std::move(end));
+        };
+        bench_threads(name, threads, per_producer * producers, [&](int t)
+                      {
+            if (t < producers)
+            {
+                for (uint64_t i = 0; i < per_producer; ++i)
+                {
+                    BroadcastTask task;
+                    task.sequence_id = 0;
+                    task.sender_name = sender;
+                    task.target_room = room;
+                    queue.push(std::move(task));
+                }
+                // the last producer queues one end marker per consumer
+                if (--producing == 0)
+                    for (int c = producers; c < threads; ++c)
+                        push_end();
+                return;
+            }
+            std::vector<BroadcastTask> batch;
+            batch.reserve(32);
+            while (true)
+            {
+                batch.clear();
+                queue.pop_batch(batch, 32);
+                int ends = 0;
+                for (const BroadcastTask &task : batch)
+                    ends += task.sequence_id == -1;
+                if (ends == 0)
+                    continue;
+                while (--ends > 0) // markers meant for other consumers
+                    push_end();
+                return;
+            } });
+    }
+}
+
+// ============================================================
+//  REGISTRY LOCK
+// ============================================================
+
+// A room lookup under registry_lock, as every handler and broadcaster does,
+// with all reads and with one write in a hundred.
+void bench_registry_lock()
+{
+    for (int write_every : {0, 100})
+    {
+        for (int threads : {1, 2, 4, 8, 16, 32})
+        {
+            std::string name = std::string("registry_lock/") + (write_every ? "read99_write1" : "read") +
+                               "/threads=" + std::to_string(threads);
+            const uint64_t per_thread = 4000000 / threads;
+            bench_threads(name, threads, per_thread * threads, [&](int)
+                          {
+                const std::string room = "room1";
+                for (uint64_t i = 0; i < per_thread; ++i)
+                {
+                    if (write_every && i % write_every == 0)
+                    {
+                        WriteLock lock(registry_lock);
+                        keep(room_members.find(room));
+                    }
+                    else
+                    {
+                        ReadLock lock(registry_lock);
+                        keep(room_members.find(room));
+                    }
+                } });
+        }
+    }
+}
+
+// ============================================================
+//  TEXT AND FRAME PARSING
+// ============================================================
+
+void bench_parsing()
+{
+    const std::vector<std::string> commands = {
+        "SAY:[alice]: hello everyone", "PING:alice", "JOIN:alice: room1;last=20", "DM:alice:bob:hi",
+        "WHO:alice>room1", "SEARCH:alice:room1:hello", "LEAVE:alice", "STATS:alice"};
+    bench("parse/find_text_command", [&](uint64_t iterations)
+          {
+        for (uint64_t i = 0; i < iterations; ++i)
+            keep(find_text_command(commands[i % commands.size()])); });
+
+    bench("parse/register_options", [](uint64_t iterations)
+          {
+        std::string_view text = "/client_alice;caps=3;overflow=drop-oldest";
+        for (uint64_t i = 0; i < iterations; ++i)
+        {
+            uint32_t caps = 0;
+            ClientOverflow overflow = ClientOverflow::Spill;
+            keep(parse_register_options(text, caps, overflow));
+        } });
+
+    bench("parse/join_options", [](uint64_t iterations)
+          {
+        std::string_view text = "room1;last=20;since=1500";
+        for (uint64_t i = 0; i < iterations; ++i)
+        {
+            BacklogRequest backlog;
+            keep(parse_join_options(text, backlog));
+        } });
+
+    bench("parse/decode_frame", [](uint64_t iterations)
+          {
+        std::string frame = encode_frame(OP_SAY, name_id("alice"), name_id("room1"), 1, "hello everyone");
+        for (uint64_t i = 0; i < iterations; ++i)
+        {
+            Frame decoded;
+            keep(decode_frame(frame.data(), frame.size(), decoded));
+        } });
+
+    // the whole text path for a command whose handler does almost nothing
+    bench("dispatch/text_ping_unknown_client", [](uint64_t iterations)
+          {
+        const char ping[] = "PING:nobody";
+        for (uint64_t i = 0; i < iterations; ++i)
+            dispatch_message(ping, sizeof(ping)); });
+}
+
+// ============================================================
+//  ROOM FAN-OUT LOOKUP
+// ============================================================
+
+// Resolving a room's members to queue handles, as the broadcaster pool does
+// for every message. Members get tiny real queues and, like registered
+// clients, keep their handle in their slot.
+void bench_room_recipients()
+{
+    for (int members : {8, 64})
+    {
+        std::string name = "fanout/room_recipients/members=" + std::to_string(members);
+        if (!selected(name))
+            continue;
+
+        std::string room = "bench_room_" + std::to_string(members);
+        std::vector<std::string> names;
+        for (int i = 0; i < members; ++i)
+        {
+            std::string member = "bench_" + std::to_string(getpid()) + "_" + std::to_string(i);
+            std::string qname = "/client_" + member;
+            mq_attr attr{};
+            attr.mq_maxmsg = 1;
+            attr.mq_msgsize = 128;
+            mq_unlink(qname.c_str());
+            mqd_t q = mq_open(qname.c_str(), O_CREAT | O_RDONLY, 0600, &attr);
+            if (q == -1)
+            {
+                perror(("mq_open " + qname).c_str());
+                break;
+            }
+            mq_close(q);
+            std::shared_ptr<ClientHandle> handle = client_handles.open(member, 0, ClientOverflow::DropNewest);
+            WriteLock lock(registry_lock);
+            add_to_room(member, room, 0);
+            client_directory.entry(member)->handle = handle;
+            names.push_back(member);
+        }
+
+        std::string sender = names.empty() ? "" : names[0];
+        bench(name, [&](uint64_t iterations)
+              {
+            std::vector<std::shared_ptr<ClientHandle>> recipients;
+            std::vector<std::string> unresolved;
+            for (uint64_t i = 0; i < iterations; ++i)
+            {
+                ReadLock lock(registry_lock);
+                auto it = room_members.find(room);
+                room_recipients(it->second, sender, recipients, unresolved);
+                keep(recipients);
+                recipients.clear();
+            } });
+
+        WriteLock lock(registry_lock);
+        for (const std::string &member : names)
+        {
+            remove_from_all_rooms(member);
+            client_directory.release(member);
+            client_handles.invalidate(member);
+            mq_unlink(("/client_" + member).c_str());
+        }
+        room_members.erase(room);
+    }
+}
+
+// ============================================================
+//  WHO ROSTERS
+// ============================================================
+
+// A WHO reply for a room of 500, from the cache and rebuilt after every
+// membership change. Members are only names here; nothing is sent.
+void bench_rosters()
+{
+    const int members = 500;
+    std::string room = "bench_roster_room";
+    {
+        WriteLock lock(registry_lock);
+        for (int i = 0; i < members; ++i)
+            add_to_room("bench_member_" + std::to_string(i), room, 0);
+    }
+
+    for (bool cached : {true, false})
+    {
+        std::string name = std::string("who/roster/members=500/") + (cached ? "cached" : "rebuilt");
+        if (!selected(name))
+            continue;
+        bench(name, [&](uint64_t iterations)
+              {
+            for (uint64_t i = 0; i < iterations; ++i)
+            {
+                if (!cached)
+                {
+                    WriteLock lock(registry_lock);
+                    room_rosters.invalidate(room);
+                }
+                keep(room_rosters.get(room));
+            } });
+    }
+
+    WriteLock lock(registry_lock);
+    for (int i = 0; i < members; ++i)
+    {
+        remove_from_all_rooms("bench_member_" + std::to_string(i));
+        client_directory.release("bench_member_" + std::to_string(i));
+    }
+    room_members.erase(room);
+    room_rosters.invalidate(room);
+}
+
+// ============================================================
+//  MESSAGE QUEUE SYSCALLS
+// ============================================================
+
+// mq_send and mq_receive on one queue, a full queue's worth at a time.
+void bench_mqueue()
+{
+    long msgsize_max = read_mqueue_limit("msgsize_max");
+    long maxmsg = std::max(1L, std::min(10L, read_mqueue_limit("msg_max")));
+    for (long size : {16L, 128L, 1024L, 8192L})
+    {
+        if (msgsize_max > 0 && size > msgsize_max)
+            continue;
+        std::string send_name = "mq/send/bytes=" + std::to_string(size);
+        std::string receive_name = "mq/receive/bytes=" + std::to_string(size);
+        if (!selected(send_name) && !selected(receive_name))
+            continue;
+
+        std::string qname = "/bench_" + std::to_string(getpid());
+        mq_attr attr{};
+        attr.mq_maxmsg = maxmsg;
+        attr.mq_msgsize = size;
+        mq_unlink(qname.c_str());
+        mqd_t q = mq_open(qname.c_str(), O_CREAT | O_RDWR, 0600, &attr);
+        if (q == -1)
+        {
+            perror(("mq_open " + qname).c_str());
+            continue;
+        }
+
+        std::vector<char> buf(size, 'x');
+        const uint64_t rounds = 200000 / maxmsg;
+        std::chrono::steady_clock::duration sending{}, receiving{};
+        uint64_t send_allocs = 0, receive_allocs = 0;
+        for (uint64_t r = 0; r < rounds; ++r)
+        {
+            uint64_t allocs = allocation_count.load();
+            auto started = std::chrono::steady_clock::now();
+            for (long i = 0; i < maxmsg; ++i)
+                mq_send(q, buf.data(), size, 0);
+            auto sent = std::chrono::steady_clock::now();
+            send_allocs += allocation_count.load() - allocs;
+            allocs = allocation_count.load();
+            for (long i = 0; i < maxmsg; ++i)
+                mq_receive(q, buf.data(), size, nullptr);
+            receiving += std::chrono::steady_clock::now() - sent;
+            sending += sent - started;
+            receive_allocs += allocation_count.load() - allocs;
+        }
+        if (selected(send_name))
+            report(send_name, sending, rounds * maxmsg, send_allocs);
+        if (selected(receive_name))
+            report(receive_name, receiving, rounds * maxmsg, receive_allocs);
+
+        mq_close(q);
+        mq_unlink(qname.c_str());
+    }
+}
+
+// ============================================================
+//  RESULTS
+// ============================================================
+
+bool write_csv(const std::string &path)
+{
+    std::ofstream out(path);
+    if (!out)
+        return false;
+    out << "name,ns_per_op,allocs_per_op,ops\n";
+    for (const BenchResult &r : bench_results)
+        out << r.name << ',' << r.ns_per_op << ',' << r.allocs_per_op << ',' << r.ops << '\n';
+    return true;
+}
+
+// Print each result next to the same benchmark in a CSV from --csv.
+bool compare_baseline(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in)
+        return false;
+    std::unordered_map<std::string, std::pair<double, double>> baseline;
+    std::string line;
+    std::getline(in, line); // header
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string name, ns, allocs;
+        if (std::getline(fields, name, ',') && std::getline(fields, ns, ',') && std::getline(fields, allocs, ','))
+            baseline[name] = {std::stod(ns), std::stod(allocs)};
+    }
+
+    std::printf("\n%-44s %12s %12s %8s %10s\n", "vs baseline", "before", "after", "change", "allocs");
+    for (const BenchResult &r : bench_results)
+    {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end())
+            continue;
+        double before = it->second.first;
+        std::printf("%-44s %9.1f ns %9.1f ns %+7.1f%% %+10.2f\n", r.name.c_str(), before, r.ns_per_op,
+                    before > 0 ? (r.ns_per_op - before) * 100 / before : 0.0, r.allocs_per_op - it->second.second);
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string csv_path, baseline_path;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc)
+            bench_filter = argv[++i];
+        else if (arg == "--csv" && i + 1 < argc)
+            csv_path = argv[++i];
+        else if (arg == "--baseline" && i + 1 < argc)
+            baseline_path = argv[++i];
+        else
+        {
+            std::cerr << "+++++ USAGE: ./bench [--filter TEXT] [--csv FILE] [--baseline FILE] +++++" << std::endl;
+            return 1;
+        }
+    }
+
+    init_registry_lock();
+
+    bench_task_queue();
+    bench_registry_lock();
+    bench_parsing();
+    bench_room_recipients();
+    bench_rosters();
+    bench_mqueue();
+
+    if (!csv_path.empty() && !write_csv(csv_path))
+    {
+        perror(csv_path.c_str());
+        return 1;
+    }
+    if (!baseline_path.empty() && !compare_baseline(baseline_path))
+    {
+        perror(baseline_path.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -5,8 +5,17 @@
 #include <chrono>
 #include <time.h>
 #include <string>
-#include <map>
-#include <regex>
+#include <vector>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include "protocol.h"
 
 // ============================================================
 //  GLOBAL VARIABLES AND CONSTANTS
@@ -14,96 +23,586 @@
 
 std::atomic<bool> keep_running(true);
 
+// --binary: send commands as protocol.h frames instead of text
+bool use_binary = false;
+uint32_t client_id = 0;
+std::atomic<uint32_t> frame_sequence(0);
+
+// --batch: receive batched deliveries and pack outgoing commands together,
+// holding a partial batch for at most batch_linger_ms
+bool use_batch = false;
+int batch_linger_ms = 5;
+
+// Queue geometry. The message size always follows the server's queue; the
+// depth of our own queue can be set with --mq-maxmsg (0 = same as server).
+long queue_maxmsg = 0;
+long queue_msgsize = 1024;
+
+// --overflow: what the server does when our queue is full (empty = server default)
+std::string overflow_policy;
+
+// --reorder-window N / --gap-timeout MS (see ReorderWindow)
+size_t reorder_window = 0;
+int gap_timeout_ms = 200;
+std::atomic<int> reorder_generation(0); // bumped by JOIN, the new room has its own sequence
+
+// --rooms: stay in every room we JOIN (CAP_ROOMS). Room messages then
+// arrive as "[#room] [SEQ:n] ...", which the reorder window passes through.
+bool use_rooms = false;
+
+// --dm-status: the server tells us what became of each DM we send (CAP_DM_STATUS)
+bool use_dm_status = false;
+
+// --shm: receive through a shared-memory ring (see protocol.h) of --shm-bytes
+bool use_shm = false;
+size_t shm_bytes = 1 << 20;
+ShmRing ring;
+
+// Blobs (see protocol.h): a SAY or DM too long for the queue is written to
+// shared memory and sent as a handle. Received blobs are previewed, saved to
+// --save-blobs DIR if given, and released back through the server queue.
+std::string self_name;
+mqd_t release_q = -1;
+std::string blob_save_dir;
+const size_t BLOB_PREVIEW = 2000;
+
+// Any command counts as liveness on the server, so the heartbeat only pings
+// when nothing else has been sent for a whole ping interval.
+const auto PING_INTERVAL = std::chrono::seconds(10);
+std::atomic<std::chrono::steady_clock::rep> last_sent(0);
+
 #define ANSI_COLOR_GREEN "\x1b[32m"
 #define ANSI_COLOR_YELLOW "\x1b[33m"
 #define ANSI_COLOR_RESET "\x1b[0m"
 
+// ============================================================
+//  COMMAND ENCODING
+// ============================================================
+
+// Packs outgoing commands into one mq message (see BATCHES in protocol.h).
+// A partial batch is sent when the next command does not fit, when it has
+// waited batch_linger_ms, or on flush().
+class CommandBatcher
+{
+public:
+    void start(mqd_t q, size_t max_bytes)
+    {
+        server_q = q;
+        writer = BatchWriter(max_bytes);
+        flusher = std::thread([this]
+                              { run(); });
+    }
+
+    void add(const std::string &command)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!writer.fits_alone(command.size()))
+        {
+            send_locked();
+            mq_send(server_q, command.data(), command.size(), PRIO_CHAT);
+            return;
+        }
+        if (!writer.add(command))
+        {
+            send_locked();
+            writer.add(command);
+        }
+        if (writer.count() == 1)
+        {
+            first_added = std::chrono::steady_clock::now();
+            cv.notify_one();
+        }
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        send_locked();
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            send_locked();
+            stopping = true;
+        }
+        cv.notify_one();
+        if (flusher.joinable())
+            flusher.join();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!stopping)
+        {
+            if (writer.empty())
+            {
+                cv.wait(lock);
+                continue;
+            }
+            auto deadline = first_added + std::chrono::milliseconds(batch_linger_ms);
+            if (cv.wait_until(lock, deadline) == std::cv_status::timeout)
+                send_locked();
+        }
+    }
+
+    void send_locked()
+    {
+        if (writer.empty())
+            return;
+        mq_send(server_q, writer.bytes().data(), writer.bytes().size(), PRIO_CHAT);
+        writer.clear();
+    }
+
+    mqd_t server_q = -1;
+    BatchWriter writer;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::chrono::steady_clock::time_point first_added;
+    bool stopping = false;
+    std::thread flusher;
+};
+
+CommandBatcher command_batcher;
+
+uint32_t room_ref(const std::string &room)
+{
+    return room.empty() ? 0 : name_id(room);
+}
+
+// Send one command. text is the legacy text form; op/room_id/payload the
+// binary form, used when the client runs with --binary. Control commands
+// skip the batcher and go out at command_priority (see protocol.h).
+void send_command(mqd_t server_q, const std::string &text, Opcode op,
+                  uint32_t room_id, const std::string &payload)
+{
+    std::string command;
+    if (use_binary)
+        command = encode_frame(op, client_id, room_id, frame_sequence++, payload);
+    else
+        command.assign(text.c_str(), text.size() + 1);
+
+    if (use_batch && !is_control_command(op))
+        command_batcher.add(command);
+    else
+    {
+        // chat typed before a JOIN or QUIT is queued ahead of it at the
+        // same priority, so the server handles it first
+        if (use_batch)
+            command_batcher.flush();
+        mq_send(server_q, command.data(), command.size(), command_priority(op));
+    }
+    last_sent = std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+// Text that would not fit in one queue message goes out as a blob handle.
+std::string blob_if_large(const std::string &text)
+{
+    if (text.size() + self_name.size() + 64 <= static_cast<size_t>(queue_msgsize))
+        return text;
+    std::string object = write_blob(self_name, text);
+    if (object.empty())
+    {
+        perror("shm_open blob");
+        return text;
+    }
+    return blob_handle(object, text.size());
+}
+
 // ============================================================
 //  HEARTBEAT SYSTEM
 // ============================================================
 
-void heartbeat_sender(const std::string &client_name, const std::string &server_qname)
+void heartbeat_sender(const std::string &client_name, mqd_t server_q)
 {
     const std::string ping_msg = "PING:" + client_name;
 
     while (keep_running)
     {
-        std::this_thread::sleep_for(std::chrono::seconds(10)); // ส่ง ping ทุก 10 วิ
+        std::this_thread::sleep_for(PING_INTERVAL); // ส่ง ping ทุก 10 วิ
         if (!keep_running)
             break;
 
-        // เปิดคิวของ server เพื่อส่ง ping
-        mqd_t server_q = mq_open(server_qname.c_str(), O_WRONLY | O_NONBLOCK);
-        mq_send(server_q, ping_msg.c_str(), ping_msg.size() + 1, 0);
-        mq_close(server_q);
+        // ถ้าเพิ่งส่งคำสั่งอื่นไปภายในรอบนี้ ไม่ต้อง ping
+        auto since = std::chrono::steady_clock::now() -
+                     std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(last_sent.load()));
+        if (since < PING_INTERVAL)
+            continue;
+
+        // pings go straight out on the shared descriptor, never batched
+        if (use_binary)
+        {
+            std::string frame = encode_frame(OP_PING, client_id, 0, frame_sequence++, "");
+            mq_send(server_q, frame.data(), frame.size(), PRIO_CONTROL);
+        }
+        else
+        {
+            mq_send(server_q, ping_msg.c_str(), ping_msg.size() + 1, PRIO_CONTROL);
+        }
+        last_sent = std::chrono::steady_clock::now().time_since_epoch().count();
     }
 }
 
 // ============================================================
-//  LISTENER THREAD
+//  REORDER WINDOW
 // ============================================================
 
-void listen_queue(const std::string &qname)
+// Parse the leading "[SEQ:n] " tag the server puts on room messages.
+// Returns -1 if the message has no tag.
+int parse_seq(const char *buf, size_t len)
+{
+    static const char tag[] = "[SEQ:";
+    const size_t tag_len = sizeof(tag) - 1;
+    if (len <= tag_len || std::memcmp(buf, tag, tag_len) != 0)
+        return -1;
+
+    int seq = 0;
+    size_t i = tag_len;
+    for (; i < len && buf[i] >= '0' && buf[i] <= '9'; ++i)
+        seq = seq * 10 + (buf[i] - '0');
+
+    if (i == tag_len || i >= len || buf[i] != ']')
+        return -1;
+    return seq;
+}
+
+struct ReorderStats
 {
-    std::map<int, std::string> msg_buffer;
-    int expected_seq = 0;
+    uint64_t held = 0;          // arrived ahead of a gap and were buffered
+    uint64_t released_late = 0; // arrived after their slot had been skipped
+    uint64_t gaps_skipped = 0;  // sequence numbers given up on
+};
+
+// Fixed-size reorder buffer for [SEQ:n] room messages. The server already
+// delivers a room in order, so this only matters when a transport can
+// reorder; with window == 0 every message passes straight through.
+//
+// A message more than `window` ahead of the next expected one, or a gap
+// that stays open longer than gap_timeout, makes the window skip ahead
+// and release what it holds, so memory stays at `window` slots.
+class ReorderWindow
+{
+public:
+    ReorderWindow(size_t window, std::chrono::milliseconds gap_timeout)
+        : slots(window), timeout(gap_timeout) {}
 
-    struct mq_attr attr;
-    attr.mq_flags = 0;
-    attr.mq_maxmsg = 10;
-    attr.mq_msgsize = 1024;
-    attr.mq_curmsgs = 0;
+    template <typename Emit>
+    void push(int seq, std::string msg, Emit emit)
+    {
+        if (slots.empty() || seq < 0)
+        {
+            emit(msg);
+            return;
+        }
 
-    mqd_t client_q = mq_open(qname.c_str(), O_CREAT | O_RDONLY, 0644, &attr);
-    char buf[1024];
+        if (expected < 0)
+            expected = seq;
 
-    std::regex seq_pattern(R"(\[SEQ:(\d+)\])");
+        if (seq < expected)
+        {
+            stats.released_late++;
+            emit(msg);
+            return;
+        }
 
-    while (keep_running)
+        if (static_cast<size_t>(seq - expected) >= slots.size())
+            skip_to(seq - static_cast<int>(slots.size()) + 1, emit);
+
+        if (seq == expected)
+        {
+            emit(msg);
+            expected++;
+            drain(emit);
+            return;
+        }
+
+        Slot &slot = slots[seq % slots.size()];
+        if (slot.used && slot.seq == seq)
+            return; // duplicate
+        slot.used = true;
+        slot.seq = seq;
+        slot.msg = std::move(msg);
+        if (held_count++ == 0)
+            gap_since = std::chrono::steady_clock::now();
+        stats.held++;
+    }
+
+    // Give up on a gap that has been open longer than the timeout.
+    template <typename Emit>
+    void poll(Emit emit)
     {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 2;
+        if (held_count == 0 || std::chrono::steady_clock::now() - gap_since < timeout)
+            return;
 
-        ssize_t n = mq_timedreceive(client_q, buf, sizeof(buf), nullptr, &ts);
-        if (n > 0)
+        int next = expected;
+        while (!slot_for(next))
+            next++;
+        skip_to(next, emit);
+    }
+
+    // Flush everything held and forget the current sequence (room switch).
+    template <typename Emit>
+    void reset(Emit emit)
+    {
+        for (int seq = expected; held_count > 0; ++seq)
         {
-            buf[n] = '\0';
-            std::string msg(buf);
+            if (Slot *slot = slot_for(seq))
+            {
+                emit(slot->msg);
+                slot->used = false;
+                slot->msg.clear();
+                held_count--;
+            }
+        }
+        expected = -1;
+    }
+
+    bool holding() const { return held_count > 0; }
+    std::chrono::milliseconds gap_timeout() const { return timeout; }
+    const ReorderStats &get_stats() const { return stats; }
 
-            std::smatch match;
-            int seq = -1;
-            if (std::regex_search(msg, match, seq_pattern))
-                seq = std::stoi(match[1]);
+private:
+    struct Slot
+    {
+        bool used = false;
+        int seq = 0;
+        std::string msg;
+    };
 
-            if (seq != -1)
+    Slot *slot_for(int seq)
+    {
+        Slot &slot = slots[seq % slots.size()];
+        return slot.used && slot.seq == seq ? &slot : nullptr;
+    }
+
+    template <typename Emit>
+    void drain(Emit emit)
+    {
+        while (Slot *slot = slot_for(expected))
+        {
+            emit(slot->msg);
+            slot->used = false;
+            slot->msg.clear();
+            held_count--;
+            expected++;
+        }
+        if (held_count > 0)
+            gap_since = std::chrono::steady_clock::now();
+    }
+
+    // Advance expected to `target`, releasing held messages in order and
+    // counting the missing ones as skipped.
+    template <typename Emit>
+    void skip_to(int target, Emit emit)
+    {
+        while (expected < target)
+        {
+            if (Slot *slot = slot_for(expected))
             {
-                msg_buffer[seq] = msg;
-
-                // print messages in correct order
-                while (msg_buffer.count(expected_seq))
-                {
-                    std::cout << "\n"
-                              << ANSI_COLOR_YELLOW << msg_buffer[expected_seq]
-                              << ANSI_COLOR_RESET << "\n"
-                              << ANSI_COLOR_GREEN << "> "
-                              << ANSI_COLOR_RESET << std::flush;
-                    msg_buffer.erase(expected_seq);
-                    expected_seq++;
-                }
+                emit(slot->msg);
+                slot->used = false;
+                slot->msg.clear();
+                held_count--;
             }
             else
             {
-                // fallback: messages without seq
-                std::cout << "\n"
-                          << ANSI_COLOR_YELLOW << msg
-                          << ANSI_COLOR_RESET << "\n"
-                          << ANSI_COLOR_GREEN << "> "
-                          << ANSI_COLOR_RESET << std::flush;
+                stats.gaps_skipped++;
             }
+            expected++;
         }
+        drain(emit);
+    }
+
+    std::vector<Slot> slots;
+    std::chrono::milliseconds timeout;
+    int expected = -1;
+    size_t held_count = 0;
+    std::chrono::steady_clock::time_point gap_since;
+    ReorderStats stats;
+};
+
+// ============================================================
+//  LISTENER THREAD
+// ============================================================
+
+// "[alice]: @blob <object> <bytes>" becomes the sender prefix and the
+// blob's contents; the blob is released as soon as it has been read.
+std::string open_blob(const std::string &msg)
+{
+    size_t body = msg.find("]: " + std::string(BLOB_TAG));
+    std::string object;
+    size_t bytes = 0;
+    if (body == std::string::npos || !parse_blob_handle(std::string_view(msg).substr(body + 3), object, bytes))
+        return msg;
+
+    std::string shown = msg.substr(0, body + 3);
+    BlobView blob;
+    if (!blob.open(object, bytes))
+        shown += "(blob no longer available)";
+    else
+    {
+        std::string_view data = blob.view();
+        shown += "(" + std::to_string(bytes) + " bytes)\n" + std::string(data.substr(0, BLOB_PREVIEW));
+        if (data.size() > BLOB_PREVIEW)
+            shown += "\n... " + std::to_string(data.size() - BLOB_PREVIEW) + " more bytes";
+        if (!blob_save_dir.empty())
+        {
+            std::string path = blob_save_dir + object; // object starts with '/'
+            std::ofstream out(path, std::ios::binary);
+            if (out.write(data.data(), data.size()))
+                shown += "\n(saved to " + path + ")";
+        }
+    }
+    send_command(release_q, "RELEASE:" + self_name + ":" + object, OP_RELEASE, 0, object);
+    return shown;
+}
+
+void print_message(const std::string &raw)
+{
+    std::string msg = open_blob(raw);
+    std::cout << "\n"
+              << ANSI_COLOR_YELLOW << msg
+              << ANSI_COLOR_RESET << "\n"
+              << ANSI_COLOR_GREEN << "> "
+              << ANSI_COLOR_RESET << std::flush;
+}
+
+// One delivery, as an mq message or a ring record: a batch or a single
+// NUL-terminated message.
+void handle_delivery(const char *buf, size_t n, ReorderWindow &window)
+{
+    if (is_batch(buf, n))
+    {
+        for_each_batch_record(buf, n, [&](std::string_view record)
+                              { window.push(parse_seq(record.data(), record.size()), std::string(record), print_message); });
+    }
+    else
+    {
+        size_t len = strnlen(buf, n);
+        window.push(parse_seq(buf, len), std::string(buf, len), print_message);
+    }
+}
+
+void print_reorder_stats(const ReorderWindow &window)
+{
+    if (reorder_window == 0)
+        return;
+    const ReorderStats &stats = window.get_stats();
+    std::cout << "Reorder window: held=" << stats.held
+              << " released_late=" << stats.released_late
+              << " gaps_skipped=" << stats.gaps_skipped << std::endl;
+}
+
+// The server fans out each room from a single worker, so room messages
+// arrive already in [SEQ:n] order. The sequence has gaps where our own
+// messages were (they are not echoed back), so the reorder window is off
+// by default and meant for receive-only bots.
+void listen_queue(mqd_t client_q)
+{
+    ReorderWindow window(reorder_window, std::chrono::milliseconds(gap_timeout_ms));
+    std::vector<char> buffer(queue_msgsize);
+    char *buf = buffer.data();
+    int generation = reorder_generation;
+
+    while (keep_running)
+    {
+        if (generation != reorder_generation)
+        {
+            generation = reorder_generation;
+            window.reset(print_message);
+        }
+
+        // wake up in time to expire an open gap
+        long wait_ms = window.holding() ? window.gap_timeout().count() : 2000;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait_ms / 1000;
+        ts.tv_nsec += (wait_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        ssize_t n = mq_timedreceive(client_q, buf, buffer.size(), nullptr, &ts);
+        if (n > 0)
+            handle_delivery(buf, n, window);
+        window.poll(print_message);
     }
     mq_close(client_q);
+    if (!use_shm)
+        print_reorder_stats(window);
+}
+
+// With --shm the server writes into the ring once it has mapped it; the
+// queue listener keeps running for anything sent before that, or for
+// everything if the server could not map the ring.
+void listen_ring()
+{
+    ReorderWindow window(reorder_window, std::chrono::milliseconds(gap_timeout_ms));
+    int generation = reorder_generation;
+
+    while (keep_running)
+    {
+        if (generation != reorder_generation)
+        {
+            generation = reorder_generation;
+            window.reset(print_message);
+        }
+
+        bool got = false;
+        while (ring.try_read([&](const char *buf, size_t n)
+                             { handle_delivery(buf, n, window); }))
+            got = true;
+        if (!got)
+            ring.wait(window.holding() ? window.gap_timeout().count() : 200); // ว่างอยู่ รอ futex
+        window.poll(print_message);
+    }
+    print_reorder_stats(window);
+}
+
+// ============================================================
+//  INGEST QUEUE SELECTION
+// ============================================================
+
+// Count the /server_<i> shards the server has opened and pick ours by name,
+// falling back to /server when the server runs a single ingest queue.
+std::string find_server_queue(const std::string &client_name)
+{
+    int count = 0;
+    while (count < MAX_INGEST_QUEUES)
+    {
+        mqd_t q = mq_open(ingest_queue_name(count).c_str(), O_WRONLY);
+        if (q == -1)
+            break;
+        mq_close(q);
+        count++;
+    }
+    return pick_ingest_queue(client_name, count);
+}
+
+// Create our own queue with the server's message size. Any queue left over
+// from a previous run is removed first so the new geometry takes effect.
+mqd_t create_client_queue(const std::string &qname)
+{
+    struct mq_attr attr;
+    attr.mq_flags = 0;
+    attr.mq_maxmsg = queue_maxmsg;
+    attr.mq_msgsize = queue_msgsize;
+    attr.mq_curmsgs = 0;
+
+    mq_unlink(qname.c_str());
+    mqd_t q = mq_open(qname.c_str(), O_CREAT | O_RDONLY, 0644, &attr);
+    if (q == -1 && errno == EINVAL && attr.mq_maxmsg > 10)
+    {
+        // deeper than fs.mqueue.msg_max allows; fall back to the default depth
+        attr.mq_maxmsg = 10;
+        q = mq_open(qname.c_str(), O_CREAT | O_RDONLY, 0644, &attr);
+    }
+    return q;
 }
 
 // ============================================================
@@ -135,14 +634,31 @@ void innitial_commands()
     std::cout << "+++++     commands for chat server    +++++" << std::endl;
     std::cout << "===========================================" << std::endl;
     std::cout << "===== JOIN  -- JOIN:<room_name>       =====" << std::endl;
+    std::cout << "=====   history: JOIN:<room>;last=<n> =====" << std::endl;
     std::cout << "===== SAY   -- SAY:<message>          =====" << std::endl;
     std::cout << "===== DM    -- DM:<target>:<message>  =====" << std::endl;
+    std::cout << "===== FILE  -- FILE:<path>            =====" << std::endl;
     std::cout << "===== WHO   -- WHO:                   =====" << std::endl;
+    std::cout << "===== SEARCH - SEARCH:<room>:<terms>  =====" << std::endl;
+    std::cout << "===== STATS -- STATS:                 =====" << std::endl;
     std::cout << "===== LEAVE -- LEAVE:                 =====" << std::endl;
+    if (use_rooms)
+        std::cout << "=====   one room: LEAVE:<room>         =====" << std::endl;
     std::cout << "===== QUIT  -- QUIT:                  =====" << std::endl;
     std::cout << "===========================================" << std::endl;
 }
 
+// Value of a numeric option: anything but a whole non-negative number
+// throws, and the caller reports it.
+long parse_count(const std::string &value, long max = LONG_MAX)
+{
+    size_t used = 0;
+    long n = std::stol(value, &used);
+    if (used != value.size() || n < 0)
+        throw std::invalid_argument(value);
+    return std::min(n, max);
+}
+
 // ============================================================
 //  MAIN FUNCTION
 // ============================================================
@@ -152,25 +668,130 @@ int main(int argc, char *argv[])
     // ตรวจสอบการใช้งาน
     if (argc < 2)
     {
-        std::cerr << "+++++ USAGE: ./<client_file> <client_name> +++++" << std::endl;
+        std::cerr << "+++++ USAGE: ./<client_file> <client_name> [--binary] [--batch] [--batch-linger MS]"
+                  << " [--reorder-window N] [--gap-timeout MS] [--mq-maxmsg N]"
+                  << " [--overflow drop-newest|drop-oldest|spill] [--shm] [--shm-bytes N] [--save-blobs DIR] [--rooms] [--dm-status] +++++" << std::endl;
+        std::cerr << "+++++ USAGE: ./<client_file> --stats-page +++++" << std::endl;
         return 1;
     }
 
+    // --stats-page: อ่านหน้า stats ใน shared memory ของ server แล้วออก ไม่ต้อง register
+    if (std::string(argv[1]) == "--stats-page")
+    {
+        std::string page;
+        int64_t updated_ms = 0;
+        if (!read_stats_page(page, &updated_ms))
+        {
+            std::cerr << "Cannot read " << STATS_PAGE_NAME << " (is the server running?)" << std::endl;
+            return 1;
+        }
+        int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                             std::chrono::system_clock::now().time_since_epoch())
+                             .count();
+        std::cout << page << "(updated " << now_ms - updated_ms << " ms ago)" << std::endl;
+        return 0;
+    }
+
     // เก็บข้อมูล client
     std::string client_name = argv[1];
+    self_name = client_name;
+    for (int i = 2; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        try
+        {
+            if (arg == "--binary")
+                use_binary = true;
+            else if (arg == "--batch")
+                use_batch = true;
+            else if (arg == "--batch-linger" && i + 1 < argc)
+                batch_linger_ms = static_cast<int>(parse_count(argv[++i], INT_MAX));
+            else if (arg == "--reorder-window" && i + 1 < argc)
+                reorder_window = parse_count(argv[++i]);
+            else if (arg == "--gap-timeout" && i + 1 < argc)
+                gap_timeout_ms = static_cast<int>(parse_count(argv[++i], INT_MAX));
+            else if (arg == "--mq-maxmsg" && i + 1 < argc)
+                queue_maxmsg = parse_count(argv[++i]);
+            else if (arg == "--overflow" && i + 1 < argc)
+                overflow_policy = argv[++i];
+            else if (arg == "--shm")
+                use_shm = true;
+            else if (arg == "--shm-bytes" && i + 1 < argc)
+                shm_bytes = parse_count(argv[++i]);
+            else if (arg == "--save-blobs" && i + 1 < argc)
+                blob_save_dir = argv[++i];
+            else if (arg == "--rooms")
+                use_rooms = true;
+            else if (arg == "--dm-status")
+                use_dm_status = true;
+        }
+        catch (const std::exception &)
+        {
+            std::cerr << "Invalid value for " << arg << ": " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+    client_id = name_id(client_name);
     std::string client_qname = "/client_" + client_name;
     std::string current_room = "";
-
-    // เริ่ม thread สำหรับรับข้อความจาก server
-    std::thread listener_thread(listen_queue, client_qname);
+    std::vector<std::string> joined_rooms; // --rooms: every room we are in
 
     // สร้าง queue สำหรับส่งไป server
-    mqd_t server_q = mq_open("/server", O_WRONLY);
-    std::string reg_msg = "REGISTER:" + client_qname;
-    mq_send(server_q, reg_msg.c_str(), reg_msg.size() + 1, 0);
+    std::string server_qname = find_server_queue(client_name);
+    mqd_t server_q = mq_open(server_qname.c_str(), O_WRONLY);
+    if (server_q == -1)
+    {
+        perror("mq_open server (is the server running?)");
+        return 1;
+    }
+    release_q = server_q;
+
+    // ขนาดข้อความของ queue ตามค่าของ server
+    struct mq_attr server_attr;
+    if (mq_getattr(server_q, &server_attr) == 0)
+    {
+        queue_msgsize = server_attr.mq_msgsize;
+        if (queue_maxmsg <= 0)
+            queue_maxmsg = server_attr.mq_maxmsg;
+    }
+    if (queue_maxmsg <= 0)
+        queue_maxmsg = 10;
+
+    // สร้าง queue ของ client ก่อน register เพื่อให้ server เปิดได้ทันที
+    mqd_t client_q = create_client_queue(client_qname);
+    if (client_q == -1)
+    {
+        perror("mq_open client queue");
+        return 1;
+    }
+
+    // สร้าง ring ใน shared memory ก่อน register เช่นกัน ถ้าสร้างไม่ได้ใช้ queue อย่างเดียว
+    if (use_shm && !ring.create(ring_name(client_name), shm_bytes))
+    {
+        perror("shm_open ring, using the message queue only");
+        use_shm = false;
+    }
+
+    // เริ่ม thread สำหรับรับข้อความจาก server
+    std::thread listener_thread(listen_queue, client_q);
+    std::thread ring_thread;
+    if (use_shm)
+        ring_thread = std::thread(listen_ring);
+
+    uint32_t caps = (use_batch ? uint32_t(CAP_BATCH) : 0u) | (use_shm ? uint32_t(CAP_SHM) : 0u) |
+                    (use_rooms ? uint32_t(CAP_ROOMS) : 0u) | (use_dm_status ? uint32_t(CAP_DM_STATUS) : 0u);
+    std::string options;
+    if (caps)
+        options += ";caps=" + std::to_string(caps);
+    if (!overflow_policy.empty())
+        options += ";overflow=" + overflow_policy;
+    std::string reg_msg = "REGISTER:" + client_qname + options;
+    if (use_batch)
+        command_batcher.start(server_q, queue_msgsize);
+    send_command(server_q, reg_msg, OP_REGISTER, caps, client_name + options); // binary REGISTER carries caps in room_id
 
     // เริ่ม thread heartbeat
-    std::thread heartbeat_thread(heartbeat_sender, client_name, "/server");
+    std::thread heartbeat_thread(heartbeat_sender, client_name, server_q);
 
     // startting client interface
     system("clear");
@@ -190,19 +811,54 @@ int main(int argc, char *argv[])
         // -----------------------------
         if (msg.rfind("SAY:", 0) == 0)
         {
-            std::string send_msg = "SAY:[" + client_name + "]: " + msg.substr(4);
-            mq_send(server_q, send_msg.c_str(), send_msg.size() + 1, 0);
+            std::string text = blob_if_large(msg.substr(4));
+            std::string send_msg = "SAY:[" + client_name + "]: " + text;
+            send_command(server_q, send_msg, OP_SAY, room_ref(current_room), text);
+        }
+        // -----------------------------
+        // Command: FILE
+        // -----------------------------
+        else if (msg.rfind("FILE:", 0) == 0)
+        {
+            // ส่งเนื้อหาไฟล์ทั้งไฟล์เป็น blob ให้ทุกคนในห้อง
+            std::ifstream in(msg.substr(5), std::ios::binary);
+            std::ostringstream contents;
+            contents << in.rdbuf();
+            std::string object = in ? write_blob(client_name, contents.str()) : "";
+            if (object.empty())
+            {
+                std::cout << "Cannot send " << msg.substr(5) << std::endl;
+            }
+            else
+            {
+                std::string text = blob_handle(object, contents.str().size());
+                std::string send_msg = "SAY:[" + client_name + "]: " + text;
+                send_command(server_q, send_msg, OP_SAY, room_ref(current_room), text);
+            }
         }
         // -----------------------------
         // Command: JOIN
         // -----------------------------
         else if (msg.rfind("JOIN:", 0) == 0)
         {
-            current_room = msg.substr(5);
-            std::string send_msg = "JOIN:" + client_name + ": " + current_room;
-            mq_send(server_q, send_msg.c_str(), send_msg.size() + 1, 0);
-            system("clear");
-            std::cout << "Joined #" << current_room << " successfully" << std::endl;
+            // JOIN:<room>;last=<n> หรือ ;since=<seq> เพื่อขอข้อความย้อนหลัง
+            std::string request = msg.substr(5);
+            current_room = request.substr(0, request.find(';'));
+            reorder_generation++;
+            std::string send_msg = "JOIN:" + client_name + ": " + request;
+            send_command(server_q, send_msg, OP_JOIN, room_ref(current_room), request);
+            if (!use_rooms)
+            {
+                system("clear");
+                std::cout << "Joined #" << current_room << " successfully" << std::endl;
+            }
+            else
+            {
+                // ห้องที่อยู่แล้วแค่กลายเป็นห้องปัจจุบัน
+                if (std::find(joined_rooms.begin(), joined_rooms.end(), current_room) == joined_rooms.end())
+                    joined_rooms.push_back(current_room);
+                std::cout << "Talking in #" << current_room << " (rooms: " << joined_rooms.size() << ")" << std::endl;
+            }
         }
         // -----------------------------
         // Command: DM
@@ -217,9 +873,9 @@ int main(int argc, char *argv[])
             }
 
             std::string target = msg.substr(3, pos - 3);
-            std::string text = msg.substr(pos + 1);
+            std::string text = blob_if_large(msg.substr(pos + 1));
             std::string send_msg = "DM:" + client_name + ":" + target + ":" + text;
-            mq_send(server_q, send_msg.c_str(), send_msg.size() + 1, 0);
+            send_command(server_q, send_msg, OP_DM, room_ref(current_room), target + ":" + text);
         }
         // -----------------------------
         // Command: WHO
@@ -227,25 +883,71 @@ int main(int argc, char *argv[])
         else if (msg.rfind("WHO:", 0) == 0)
         {
             std::string send_msg = "WHO:" + client_name + ">" + current_room;
-            mq_send(server_q, send_msg.c_str(), send_msg.size() + 1, 0);
+            send_command(server_q, send_msg, OP_WHO, room_ref(current_room), current_room);
+        }
+        // -----------------------------
+        // Command: SEARCH
+        // -----------------------------
+        else if (msg.rfind("SEARCH:", 0) == 0)
+        {
+            // SEARCH:<room>:<terms> ค้นหาในประวัติของห้อง (server ต้องเปิด --log-dir)
+            std::string query = msg.substr(7);
+            size_t colon = query.find(':');
+            if (colon == std::string::npos)
+            {
+                std::cout << "Usage: SEARCH:<room>:<terms>" << std::endl;
+            }
+            else
+            {
+                std::string send_msg = "SEARCH:" + client_name + ":" + query;
+                send_command(server_q, send_msg, OP_SEARCH, room_ref(query.substr(0, colon)), query);
+            }
+        }
+        // -----------------------------
+        // Command: STATS
+        // -----------------------------
+        else if (msg.rfind("STATS:", 0) == 0)
+        {
+            std::string send_msg = "STATS:" + client_name;
+            send_command(server_q, send_msg, OP_STATS, room_ref(current_room), "");
         }
         // -----------------------------
         // Command: LEAVE
         // -----------------------------
+        else if (msg.rfind("LEAVE:", 0) == 0 && use_rooms && msg.size() > 6)
+        {
+            // LEAVE:<room> ออกห้องเดียว ห้องอื่นยังอยู่
+            std::string room = msg.substr(6);
+            auto it = std::find(joined_rooms.begin(), joined_rooms.end(), room);
+            if (it == joined_rooms.end())
+            {
+                std::cout << "You are not in #" << room << std::endl;
+            }
+            else
+            {
+                joined_rooms.erase(it);
+                if (current_room == room)
+                    current_room = joined_rooms.empty() ? "" : joined_rooms.back();
+                std::cout << "You left room #" << room << std::endl;
+                std::string payload = "LEAVE:" + client_name + ":" + room;
+                send_command(server_q, payload, OP_LEAVE, 0, room);
+            }
+        }
         else if (msg.rfind("LEAVE:", 0) == 0)
         {
             if (current_room.empty())
             {
                 std::cout << "You are not in any room." << std::endl;
             }
-            else if (confirm_action("leave room #" + current_room))
+            else if (confirm_action(joined_rooms.size() > 1 ? "leave every room" : "leave room #" + current_room))
             {
                 system("clear");
-                std::cout << "You left room #" << current_room << std::endl;
+                std::cout << "You left " << (joined_rooms.size() > 1 ? "every room" : "room #" + current_room) << std::endl;
                 innitial_commands();
                 current_room.clear();
+                joined_rooms.clear();
                 std::string payload = "LEAVE:" + client_name;
-                mq_send(server_q, payload.c_str(), payload.size() + 1, 0);
+                send_command(server_q, payload, OP_LEAVE, 0, "");
             }
         }
         // -----------------------------
@@ -262,13 +964,13 @@ int main(int argc, char *argv[])
             if (!current_room.empty())
             {
                 std::string payload_leave = "LEAVE:" + client_name;
-                mq_send(server_q, payload_leave.c_str(), payload_leave.size() + 1, 0);
+                send_command(server_q, payload_leave, OP_LEAVE, 0, "");
                 std::cout << "You left room before quitting." << std::endl;
                 current_room.clear();
             }
 
             std::string payload_quit = "QUIT:" + client_name;
-            mq_send(server_q, payload_quit.c_str(), payload_quit.size() + 1, 0);
+            send_command(server_q, payload_quit, OP_QUIT, 0, "");
 
             keep_running = false;
             break;
@@ -288,9 +990,15 @@ int main(int argc, char *argv[])
     }
 
     // ปิดการเชื่อมต่อ
-    mq_close(server_q);
+    if (use_batch)
+        command_batcher.stop();
     listener_thread.join();
+    if (ring_thread.joinable())
+        ring_thread.join();
     heartbeat_thread.join();
+    mq_close(server_q);
+    if (use_shm)
+        shm_unlink(ring_name(client_name).c_str());
     mq_unlink(client_qname.c_str());
     return 0;
 }
@@ -0,0 +1,798 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// ============================================================
+//  BINARY FRAME PROTOCOL
+// ============================================================
+//
+// A binary frame is a fixed 16-byte header followed by payload_len bytes of
+// payload. Text commands ("SAY:...", "JOIN:...") always start with an ASCII
+// letter, so the server tells the two apart by the first byte alone.
+//
+// Ids are FNV-1a hashes of the client / room name, so a client can fill
+// them in without a round trip to the server. The server keeps an id->name
+// table that is populated on REGISTER and JOIN.
+//
+// Payload per opcode:
+//   REGISTER  client name, optionally followed by ";overflow=<policy>"
+//   JOIN      room name
+//   SAY       message text (the server adds the "[name]: " prefix)
+//   DM        <target>:<message>
+//   WHO       room name, or empty to use room_id
+//   LEAVE     room name, or empty for every room
+//   QUIT / PING  empty
+//   SEARCH    <room>:<terms>
+//   STATS     empty
+//   RELEASE   blob name (see BLOBS)
+
+constexpr uint8_t FRAME_MAGIC = 0xC5;
+
+enum Opcode : uint8_t
+{
+    OP_REGISTER = 1,
+    OP_JOIN,
+    OP_SAY,
+    OP_DM,
+    OP_WHO,
+    OP_LEAVE,
+    OP_QUIT,
+    OP_PING,
+    OP_SEARCH,
+    OP_STATS,
+    OP_RELEASE,
+    OP_COUNT
+};
+
+struct FrameHeader
+{
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t payload_len;
+    uint32_t sender_id;
+    uint32_t room_id;
+    uint32_t sequence;
+};
+static_assert(sizeof(FrameHeader) == 16, "FrameHeader must stay 16 bytes");
+
+// A decoded frame. payload points into the receive buffer; it is only valid
+// until the next mq_receive into that buffer.
+struct Frame
+{
+    FrameHeader header;
+    std::string_view payload;
+};
+
+inline uint32_t name_id(std::string_view name)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+inline bool is_binary_frame(const char *buf, size_t len)
+{
+    return len >= sizeof(FrameHeader) && static_cast<uint8_t>(buf[0]) == FRAME_MAGIC;
+}
+
+// Decode a frame in place. Returns false on a short or malformed frame.
+inline bool decode_frame(const char *buf, size_t len, Frame &out)
+{
+    if (!is_binary_frame(buf, len))
+        return false;
+
+    std::memcpy(&out.header, buf, sizeof(FrameHeader));
+    if (out.header.opcode == 0 || out.header.opcode >= OP_COUNT)
+        return false;
+    if (sizeof(FrameHeader) + out.header.payload_len > len)
+        return false;
+
+    out.payload = std::string_view(buf + sizeof(FrameHeader), out.header.payload_len);
+    return true;
+}
+
+inline std::string encode_frame(Opcode op, uint32_t sender_id, uint32_t room_id,
+                                uint32_t sequence, std::string_view payload)
+{
+    FrameHeader header;
+    header.magic = FRAME_MAGIC;
+    header.opcode = op;
+    header.payload_len = static_cast<uint16_t>(payload.size());
+    header.sender_id = sender_id;
+    header.room_id = room_id;
+    header.sequence = sequence;
+
+    std::string frame(sizeof(FrameHeader) + payload.size(), '\0');
+    std::memcpy(&frame[0], &header, sizeof(FrameHeader));
+    if (!payload.empty())
+        std::memcpy(&frame[sizeof(FrameHeader)], payload.data(), payload.size());
+    return frame;
+}
+
+// ============================================================
+//  MESSAGE PRIORITIES
+// ============================================================
+//
+// mq_receive returns the oldest message of the highest priority, so
+// REGISTER and PING are sent at PRIO_CONTROL and overtake a backlog of chat
+// in the server's queues. The server does the same with its [SYSTEM]
+// notices in client queues. JOIN, LEAVE and QUIT change which room a text
+// SAY goes to, or whether it goes anywhere, so they stay at PRIO_CHAT
+// behind the chat the client sent before them. Everything else, and every
+// batch, goes at PRIO_CHAT. Shared-memory rings are strictly FIFO.
+
+constexpr unsigned PRIO_CHAT = 0;
+constexpr unsigned PRIO_CONTROL = 1;
+
+inline unsigned command_priority(Opcode op)
+{
+    switch (op)
+    {
+    case OP_REGISTER:
+    case OP_PING:
+        return PRIO_CONTROL;
+    default:
+        return PRIO_CHAT;
+    }
+}
+
+// Control commands go out on their own, never inside a batch.
+inline bool is_control_command(Opcode op)
+{
+    switch (op)
+    {
+    case OP_REGISTER:
+    case OP_JOIN:
+    case OP_LEAVE:
+    case OP_QUIT:
+    case OP_PING:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// ============================================================
+//  CLIENT CAPABILITIES
+// ============================================================
+//
+// Announced at REGISTER: in the text form as "REGISTER:/client_<name>;caps=<bits>",
+// in a binary REGISTER frame through the room_id field. A REGISTER may also
+// ask for a full-queue policy with ";overflow=drop-newest|drop-oldest|spill".
+//
+// A CAP_ROOMS client stays in every room it joins: JOIN adds a room (and
+// makes it the one a SAY without a room goes to), "LEAVE:<name>:<room>"
+// leaves one, "LEAVE:<name>" all of them. Each room message it receives
+// starts with the room, "[#room] [SEQ:n] ...". Other clients are in one
+// room at a time and get untagged messages.
+//
+// A CAP_DM_STATUS client is told what became of every DM it sends, as
+// "[DM to <target>]: <status>", or "[DM to <target>]: <n> <status>" for a
+// run of them: delivered (in the recipient's queue), queued (the server is
+// holding it, behind a full queue or for a recipient that has just left),
+// dropped (the recipient's queue was full) or offline. A DM held for a
+// recipient that left is followed by a second status once it is delivered
+// or given up on. Without the capability only "offline" is reported, as
+// "[Server]: user '<target>' not found.".
+
+enum ClientCaps : uint32_t
+{
+    CAP_BATCH = 1,    // client unpacks batched deliveries
+    CAP_SHM = 2,      // client reads deliveries from its shared-memory ring
+    CAP_ROOMS = 4,    // client subscribes to several rooms at once
+    CAP_DM_STATUS = 8 // client wants a delivery status for each DM it sends
+};
+
+// ============================================================
+//  BATCHES
+// ============================================================
+//
+// Several messages packed into one mq message, in either direction:
+//   [BATCH_MAGIC][uint16 count] then count x [uint16 length][bytes]
+// Server->client records are message text without the NUL; client->server
+// records are complete commands exactly as they would be sent on their own.
+
+constexpr uint8_t BATCH_MAGIC = 0xC6;
+constexpr size_t BATCH_HEADER = 3;
+constexpr size_t BATCH_RECORD_HEADER = 2;
+
+class BatchWriter
+{
+public:
+    explicit BatchWriter(size_t max_bytes = 1024) : limit(max_bytes) { clear(); }
+
+    // Returns false if the record does not fit; the caller flushes and retries.
+    bool add(std::string_view record)
+    {
+        if (buf.size() + BATCH_RECORD_HEADER + record.size() > limit || records == UINT16_MAX)
+            return false;
+
+        uint16_t len = static_cast<uint16_t>(record.size());
+        buf.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        buf.append(record.data(), record.size());
+        records++;
+        std::memcpy(&buf[1], &records, sizeof(records));
+        return true;
+    }
+
+    // Whether a record of this size could ever go into a batch.
+    bool fits_alone(size_t record_size) const
+    {
+        return BATCH_HEADER + BATCH_RECORD_HEADER + record_size <= limit;
+    }
+
+    void clear()
+    {
+        buf.assign(BATCH_HEADER, '\0');
+        buf[0] = static_cast<char>(BATCH_MAGIC);
+        records = 0;
+    }
+
+    bool empty() const { return records == 0; }
+    uint16_t count() const { return records; }
+    const std::string &bytes() const { return buf; }
+
+private:
+    std::string buf;
+    size_t limit;
+    uint16_t records;
+};
+
+inline bool is_batch(const char *buf, size_t len)
+{
+    return len >= BATCH_HEADER && static_cast<uint8_t>(buf[0]) == BATCH_MAGIC;
+}
+
+// Call fn(std::string_view record) for every record. Returns false if the
+// batch is truncated or malformed (records before the damage are still
+// delivered).
+template <typename Fn>
+bool for_each_batch_record(const char *buf, size_t len, Fn fn)
+{
+    if (!is_batch(buf, len))
+        return false;
+
+    uint16_t count;
+    std::memcpy(&count, buf + 1, sizeof(count));
+
+    size_t pos = BATCH_HEADER;
+    for (uint16_t i = 0; i < count; ++i)
+    {
+        if (pos + BATCH_RECORD_HEADER > len)
+            return false;
+        uint16_t rec_len;
+        std::memcpy(&rec_len, buf + pos, sizeof(rec_len));
+        pos += BATCH_RECORD_HEADER;
+        if (pos + rec_len > len)
+            return false;
+        fn(std::string_view(buf + pos, rec_len));
+        pos += rec_len;
+    }
+    return true;
+}
+
+// ============================================================
+//  INGEST QUEUES
+// ============================================================
+//
+// "/server" is always served. A server started with --ingest-queues N > 1
+// also serves "/server_0" .. "/server_<N-1>", and a client sends all of its
+// commands to the one its name hashes to, so they stay in order.
+
+constexpr int MAX_INGEST_QUEUES = 64;
+
+inline std::string ingest_queue_name(int index)
+{
+    return "/server_" + std::to_string(index);
+}
+
+inline std::string pick_ingest_queue(std::string_view client_name, int queue_count)
+{
+    if (queue_count <= 1)
+        return "/server";
+    return ingest_queue_name(name_id(client_name) % queue_count);
+}
+
+// ============================================================
+//  SHARED-MEMORY RING
+// ============================================================
+//
+// Optional server->client transport for clients on the same host. The
+// client creates "/chat_ring_<name>" before it registers with CAP_SHM; the
+// server maps it and writes each delivery (the same bytes it would have
+// passed to mq_send) into the ring instead of the client's queue. The queue
+// stays open and is used whenever the ring cannot be attached.
+//
+// Records are [uint32 length][bytes], padded to 8 bytes. RING_WRAP in the
+// length slot means the rest of the buffer is unused and the next record
+// starts at offset 0. The ring is single-producer / single-consumer; the
+// server serialises its writers per client. The consumer only sleeps on the
+// futex after finding the ring empty, and the producer only calls
+// FUTEX_WAKE when it sees the consumer asleep.
+
+constexpr uint32_t RING_MAGIC = 0x474E4952; // "RING"
+constexpr uint32_t RING_WRAP = 0xFFFFFFFF;
+
+struct RingHeader
+{
+    uint32_t magic;
+    uint32_t capacity; // data bytes, a power of two
+    alignas(64) std::atomic<uint64_t> head;  // bytes written, owned by the producer
+    alignas(64) std::atomic<uint64_t> tail;  // bytes read, owned by the consumer
+    alignas(64) std::atomic<uint32_t> wake;  // futex word, bumped on every wake-up
+    std::atomic<uint32_t> sleeping;          // consumer is (about to be) in FUTEX_WAIT
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring counters must be lock-free to share them");
+
+inline std::string ring_name(std::string_view client_name)
+{
+    return "/chat_ring_" + std::string(client_name);
+}
+
+class ShmRing
+{
+public:
+    ShmRing() = default;
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+    ~ShmRing() { unmap(); }
+
+    // Consumer side: create (replacing any stale ring) with at least
+    // `bytes` of data space.
+    bool create(const std::string &name, size_t bytes)
+    {
+        uint32_t capacity = 4096;
+        while (capacity < bytes && capacity < (1u << 30))
+            capacity <<= 1;
+
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd == -1)
+            return false;
+        size_t len = sizeof(RingHeader) + capacity;
+        bool ok = ftruncate(fd, len) == 0 && map(fd, len);
+        close(fd);
+        if (!ok)
+        {
+            shm_unlink(name.c_str());
+            return false;
+        }
+
+        new (hdr) RingHeader();
+        hdr->capacity = capacity;
+        hdr->magic = RING_MAGIC;
+        ring_capacity = capacity;
+        return true;
+    }
+
+    // Producer side: map a ring the consumer created. The capacity and head
+    // are checked once here and kept privately afterwards, since the
+    // consumer can scribble over the header at any time.
+    bool attach(const std::string &name)
+    {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd == -1)
+            return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) > sizeof(RingHeader) &&
+                  map(fd, st.st_size);
+        close(fd);
+        if (ok)
+        {
+            const uint64_t capacity = hdr->capacity;
+            const uint64_t head = hdr->head.load(std::memory_order_relaxed);
+            if (hdr->magic != RING_MAGIC || capacity < 4096 || (capacity & (capacity - 1)) != 0 ||
+                sizeof(RingHeader) + capacity != map_len || (head & 7) != 0)
+            {
+                unmap();
+                return false;
+            }
+            ring_capacity = capacity;
+            produced = head;
+        }
+        return ok;
+    }
+
+    // Append one record. Returns false with errno EAGAIN when the ring is
+    // full, EMSGSIZE when the record can never fit, or EPROTO when the
+    // consumer's tail has moved somewhere it cannot be.
+    bool try_write(const char *src, size_t size)
+    {
+        const uint64_t capacity = ring_capacity;
+        const uint64_t need = record_bytes(size);
+        if (need > capacity / 2)
+        {
+            errno = EMSGSIZE;
+            return false;
+        }
+
+        uint64_t head = produced;
+        uint64_t tail = hdr->tail.load(std::memory_order_acquire);
+        if (tail > head || head - tail > capacity)
+        {
+            errno = EPROTO;
+            return false;
+        }
+        uint64_t to_end = capacity - (head & (capacity - 1));
+        uint64_t total = to_end < need ? to_end + need : need;
+        if (head + total - tail > capacity)
+        {
+            errno = EAGAIN;
+            return false;
+        }
+
+        if (to_end < need)
+        {
+            std::memcpy(data + (head & (capacity - 1)), &RING_WRAP, sizeof(RING_WRAP));
+            head += to_end;
+        }
+        uint32_t len = static_cast<uint32_t>(size);
+        char *slot = data + (head & (capacity - 1));
+        std::memcpy(slot, &len, sizeof(len));
+        std::memcpy(slot + sizeof(len), src, size);
+        produced = head + need;
+        hdr->head.store(produced, std::memory_order_release);
+
+        // pairs with the fence in wait(): either it sees the new head or we
+        // see it sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (hdr->sleeping.load(std::memory_order_relaxed))
+        {
+            hdr->wake.fetch_add(1, std::memory_order_release);
+            futex(FUTEX_WAKE, 1, nullptr);
+        }
+        return true;
+    }
+
+    // Call fn(const char *data, size_t size) on the oldest record, in place,
+    // then release it. Returns false if the ring is empty.
+    template <typename Fn>
+    bool try_read(Fn fn)
+    {
+        const uint64_t capacity = ring_capacity;
+        uint64_t tail = hdr->tail.load(std::memory_order_relaxed);
+        if (tail == hdr->head.load(std::memory_order_acquire))
+            return false;
+
+        uint32_t len;
+        std::memcpy(&len, data + (tail & (capacity - 1)), sizeof(len));
+        if (len == RING_WRAP)
+        {
+            tail += capacity - (tail & (capacity - 1));
+            std::memcpy(&len, data, sizeof(len));
+        }
+        fn(static_cast<const char *>(data + (tail & (capacity - 1)) + sizeof(len)), static_cast<size_t>(len));
+        hdr->tail.store(tail + record_bytes(len), std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: sleep until the producer writes or timeout_ms passes.
+    void wait(int timeout_ms)
+    {
+        uint32_t seen = hdr->wake.load(std::memory_order_acquire);
+        hdr->sleeping.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (hdr->head.load(std::memory_order_relaxed) == hdr->tail.load(std::memory_order_relaxed))
+        {
+            struct timespec ts;
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            futex(FUTEX_WAIT, seen, &ts);
+        }
+        hdr->sleeping.store(0, std::memory_order_relaxed);
+    }
+
+    bool mapped() const { return hdr != nullptr; }
+    size_t capacity() const { return hdr ? ring_capacity : 0; }
+
+private:
+    static uint64_t record_bytes(size_t size) { return (sizeof(uint32_t) + size + 7) & ~uint64_t(7); }
+
+    bool map(int fd, size_t len)
+    {
+        void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            return false;
+        hdr = static_cast<RingHeader *>(p);
+        data = static_cast<char *>(p) + sizeof(RingHeader);
+        map_len = len;
+        return true;
+    }
+
+    void unmap()
+    {
+        if (hdr)
+            munmap(hdr, map_len);
+        hdr = nullptr;
+        data = nullptr;
+        map_len = 0;
+        ring_capacity = 0;
+        produced = 0;
+    }
+
+    long futex(int op, uint32_t value, const struct timespec *timeout)
+    {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&hdr->wake), op, value, timeout, nullptr, 0);
+    }
+
+    RingHeader *hdr = nullptr;
+    char *data = nullptr;
+    size_t map_len = 0;
+    uint64_t ring_capacity = 0; // as validated when mapped
+    uint64_t produced = 0;      // producer's own copy of head
+};
+
+// ============================================================
+//  CAPTURE FILES
+// ============================================================
+//
+// A server started with --capture FILE appends every message it receives
+// on its ingest queues, byte for byte, to FILE. The file is a
+// CaptureHeader followed by records of
+//   [CaptureRecordHeader][sender name][message bytes]
+// where offset_ns counts from the start of the capture and the sender is
+// the client that sent the message (empty if it could not be told). The
+// replayer (./test replay FILE) reads it back with CaptureReader.
+
+constexpr char CAPTURE_MAGIC[8] = {'C', 'H', 'A', 'T', 'C', 'A', 'P', '1'};
+
+struct CaptureHeader
+{
+    char magic[8];
+    uint32_t mq_msgsize; // of the server that captured
+    uint32_t reserved;
+    int64_t started_unix_ns;
+};
+
+struct CaptureRecordHeader
+{
+    uint64_t offset_ns;
+    uint16_t sender_len;
+    uint16_t reserved;
+    uint32_t length;
+};
+
+struct CaptureRecord
+{
+    uint64_t offset_ns = 0;
+    std::string sender;
+    std::string bytes;
+};
+
+class CaptureReader
+{
+public:
+    ~CaptureReader()
+    {
+        if (in)
+            std::fclose(in);
+    }
+
+    bool open(const std::string &path)
+    {
+        in = std::fopen(path.c_str(), "rb");
+        return in && std::fread(&header, sizeof(header), 1, in) == 1 &&
+               std::memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) == 0;
+    }
+
+    // False at the end of the file, or at a record cut short by a crash.
+    bool next(CaptureRecord &out)
+    {
+        CaptureRecordHeader rec;
+        if (std::fread(&rec, sizeof(rec), 1, in) != 1)
+            return false;
+        out.offset_ns = rec.offset_ns;
+        out.sender.resize(rec.sender_len);
+        out.bytes.resize(rec.length);
+        return (rec.sender_len == 0 || std::fread(&out.sender[0], rec.sender_len, 1, in) == 1) &&
+               (rec.length == 0 || std::fread(&out.bytes[0], rec.length, 1, in) == 1);
+    }
+
+    const CaptureHeader &info() const { return header; }
+
+private:
+    std::FILE *in = nullptr;
+    CaptureHeader header{};
+};
+
+// ============================================================
+//  BLOBS
+// ============================================================
+//
+// A message too large for the queue travels as a shared-memory object. The
+// sender writes the bytes to "/chat_blob_<name>_<n>" and says a handle,
+// "@blob <object> <bytes>", in place of the text. The server checks the
+// object belongs to the sender, copies it once into a read-only object of
+// its own (unlinking the sender's) and counts one holder per recipient;
+// each recipient maps the copy read-only and answers
+// RELEASE:<name>:<object> when done. The server unlinks the copy when the
+// last holder releases it (or disconnects), so the payload is never copied
+// per recipient.
+
+constexpr const char *BLOB_TAG = "@blob ";
+
+inline std::string blob_prefix(std::string_view client_name)
+{
+    return "/chat_blob_" + std::string(client_name) + "_";
+}
+
+inline std::string blob_handle(std::string_view object, size_t bytes)
+{
+    return BLOB_TAG + std::string(object) + " " + std::to_string(bytes);
+}
+
+// Split "@blob <object> <bytes>" (anywhere it starts the text).
+inline bool parse_blob_handle(std::string_view text, std::string &object, size_t &bytes)
+{
+    size_t tag = strlen(BLOB_TAG);
+    if (text.substr(0, tag) != BLOB_TAG)
+        return false;
+    text.remove_prefix(tag);
+    size_t space = text.find(' ');
+    if (space == std::string_view::npos || space == 0 || text[0] != '/')
+        return false;
+    std::string_view size = text.substr(space + 1);
+    if (size.empty() || size.find_first_not_of("0123456789") != std::string_view::npos)
+        return false;
+    object.assign(text.substr(0, space));
+    bytes = std::stoull(std::string(size));
+    return true;
+}
+
+// Sender side: write data to a fresh object and return its name, or an
+// empty string (with errno set) if it could not be created.
+inline std::string write_blob(std::string_view client_name, std::string_view data)
+{
+    static std::atomic<uint32_t> counter(0);
+    std::string object;
+    int fd = -1;
+    for (int attempt = 0; attempt < 64 && fd == -1; ++attempt)
+    {
+        object = blob_prefix(client_name) + std::to_string(getpid()) +
+                 std::to_string(counter.fetch_add(1, std::memory_order_relaxed));
+        fd = shm_open(object.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd == -1 && errno != EEXIST)
+            return "";
+    }
+    if (fd == -1)
+        return "";
+    bool ok = ftruncate(fd, static_cast<off_t>(data.size())) == 0;
+    if (ok && !data.empty())
+    {
+        void *p = mmap(nullptr, data.size(), PROT_WRITE, MAP_SHARED, fd, 0);
+        ok = p != MAP_FAILED;
+        if (ok)
+        {
+            memcpy(p, data.data(), data.size());
+            munmap(p, data.size());
+        }
+    }
+    close(fd);
+    if (!ok)
+    {
+        int saved = errno;
+        shm_unlink(object.c_str());
+        errno = saved;
+        return "";
+    }
+    return object;
+}
+
+// Recipient side: a read-only mapping of a blob, unmapped on destruction.
+class BlobView
+{
+public:
+    BlobView() = default;
+    BlobView(const BlobView &) = delete;
+    BlobView &operator=(const BlobView &) = delete;
+    ~BlobView()
+    {
+        if (data_ && size_)
+            munmap(const_cast<char *>(data_), size_);
+    }
+
+    bool open(const std::string &object, size_t bytes)
+    {
+        int fd = shm_open(object.c_str(), O_RDONLY, 0);
+        if (fd == -1)
+            return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == bytes;
+        if (ok && bytes)
+        {
+            void *p = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok)
+                data_ = static_cast<const char *>(p);
+        }
+        close(fd);
+        if (ok)
+            size_ = bytes;
+        return ok;
+    }
+
+    std::string_view view() const { return {data_ ? data_ : "", size_}; }
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// ============================================================
+//  STATS PAGE
+// ============================================================
+//
+// The server republishes its metrics, as the same text lines a STATS
+// command returns, to the shared-memory object STATS_PAGE_NAME. The page is
+// a StatsPageHeader followed by STATS_PAGE_BYTES of text and is guarded by a
+// sequence lock: version is odd while the server is rewriting it, so a
+// reader copies the text and retries if the version was odd or changed.
+
+constexpr const char *STATS_PAGE_NAME = "/chat_stats";
+constexpr uint32_t STATS_MAGIC = 0x54415453; // "STAT"
+constexpr size_t STATS_PAGE_BYTES = 64 * 1024;
+
+struct StatsPageHeader
+{
+    uint32_t magic;
+    std::atomic<uint32_t> length;   // bytes of text after the header
+    std::atomic<uint64_t> version;  // odd while a write is in progress
+    std::atomic<int64_t> updated_ms; // CLOCK_REALTIME of the last publish
+};
+
+// Copy the current page into out. Returns false if the server has never
+// published one or it is being rewritten faster than we can read it.
+inline bool read_stats_page(std::string &out, int64_t *updated_ms = nullptr)
+{
+    int fd = shm_open(STATS_PAGE_NAME, O_RDONLY, 0);
+    if (fd == -1)
+        return false;
+    size_t len = sizeof(StatsPageHeader) + STATS_PAGE_BYTES;
+    void *p = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+
+    const StatsPageHeader *hdr = static_cast<const StatsPageHeader *>(p);
+    const char *text = static_cast<const char *>(p) + sizeof(StatsPageHeader);
+    bool ok = false;
+    for (int attempt = 0; attempt < 100 && hdr->magic == STATS_MAGIC && !ok; ++attempt)
+    {
+        uint64_t before = hdr->version.load(std::memory_order_acquire);
+        if (before & 1)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        out.assign(text, std::min<size_t>(hdr->length.load(std::memory_order_relaxed), STATS_PAGE_BYTES));
+        if (updated_ms)
+            *updated_ms = hdr->updated_ms.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        ok = hdr->version.load(std::memory_order_relaxed) == before;
+    }
+    munmap(p, len);
+    return ok;
+}
+
+#endif
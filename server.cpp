@@ -4,59 +4,538 @@
 #include <mqueue.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #include <cstring>
 #include <unistd.h>
 #include <mutex>
 #include <map>
 #include <algorithm>
 #include <pthread.h>
+#include <csignal>
 #include <string>
-#include <queue>
 #include <cstdio>
 #include <errno.h>
 #include <chrono>
 #include <condition_variable>
 #include <cstdlib>
+#include <cctype>
+#include <new>
+#include <deque>
+#include <queue>
+#include <fstream>
+#include <sstream>
+#include <initializer_list>
 #include <atomic>
+#include <string_view>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include "protocol.h"
 
 // ============================================================
 //  STRUCTS AND UTILITY CLASSES
 // ============================================================
 
+// ============================================================
+//  SHARED PAYLOADS
+// ============================================================
+
+// Bytes of one outgoing message, allocated from PayloadPool and shared by
+// reference count. A payload is encoded once by its producer, gets its
+// [SEQ:n] tag written into the reserved headroom by the broadcaster, and is
+// then read-only: every recipient is sent the same bytes.
+struct PayloadBuffer
+{
+    std::atomic<int> refs;
+    uint32_t size_class; // index into PayloadPool, or NUM_CLASSES if unpooled
+    uint32_t capacity;
+    uint32_t offset; // start of the content; bytes before it are headroom
+    uint32_t length; // content length, excluding the trailing NUL
+
+    char *bytes() { return reinterpret_cast<char *>(this + 1); }
+};
+
+// Size-classed free lists. Each thread keeps a small cache per class so the
+// common case is a vector pop/push with no locking; overflow goes to a
+// shared list under a mutex. Buffers may be released by a different thread
+// than the one that acquired them.
+class PayloadPool
+{
+public:
+    static const uint32_t NUM_CLASSES = 6; // 128 B .. 4 KB
+    static const size_t THREAD_CACHE = 64;
+
+    static PayloadBuffer *acquire(size_t capacity)
+    {
+        uint32_t cls = class_for(capacity);
+        PayloadBuffer *buf = nullptr;
+
+        if (cls < NUM_CLASSES)
+        {
+            std::vector<PayloadBuffer *> &cache = local().free[cls];
+            if (cache.empty())
+                refill(cls, cache);
+            if (!cache.empty())
+            {
+                buf = cache.back();
+                cache.pop_back();
+            }
+        }
+
+        if (!buf)
+        {
+            uint32_t bytes = cls < NUM_CLASSES ? class_size(cls) : static_cast<uint32_t>(capacity);
+            buf = static_cast<PayloadBuffer *>(std::malloc(sizeof(PayloadBuffer) + bytes));
+            if (!buf)
+                throw std::bad_alloc();
+            new (&buf->refs) std::atomic<int>(0);
+            buf->size_class = cls;
+            buf->capacity = bytes;
+        }
+
+        buf->refs.store(1, std::memory_order_relaxed);
+        buf->offset = 0;
+        buf->length = 0;
+        return buf;
+    }
+
+    static void release(PayloadBuffer *buf)
+    {
+        if (buf->size_class >= NUM_CLASSES)
+        {
+            std::free(buf);
+            return;
+        }
+
+        std::vector<PayloadBuffer *> &cache = local().free[buf->size_class];
+        if (cache.size() < THREAD_CACHE)
+        {
+            cache.push_back(buf);
+            return;
+        }
+
+        Shared &shared = shared_lists();
+        std::lock_guard<std::mutex> lock(shared.mtx);
+        shared.free[buf->size_class].push_back(buf);
+    }
+
+private:
+    static uint32_t class_size(uint32_t cls) { return 128u << cls; }
+
+    static uint32_t class_for(size_t capacity)
+    {
+        for (uint32_t cls = 0; cls < NUM_CLASSES; ++cls)
+            if (capacity <= class_size(cls))
+                return cls;
+        return NUM_CLASSES;
+    }
+
+    struct Shared
+    {
+        std::mutex mtx;
+        std::vector<PayloadBuffer *> free[NUM_CLASSES];
+    };
+
+    struct ThreadCache
+    {
+        std::vector<PayloadBuffer *> free[NUM_CLASSES];
+
+        ThreadCache()
+        {
+            for (auto &list : free)
+                list.reserve(THREAD_CACHE);
+        }
+
+        // hand buffers back when the thread exits
+        ~ThreadCache()
+        {
+            Shared &shared = shared_lists();
+            std::lock_guard<std::mutex> lock(shared.mtx);
+            for (uint32_t cls = 0; cls < NUM_CLASSES; ++cls)
+                shared.free[cls].insert(shared.free[cls].end(), free[cls].begin(), free[cls].end());
+        }
+    };
+
+    static Shared &shared_lists()
+    {
+        static Shared *shared = new Shared; // outlives every thread cache
+        return *shared;
+    }
+
+    static ThreadCache &local()
+    {
+        thread_local ThreadCache cache;
+        return cache;
+    }
+
+    static void refill(uint32_t cls, std::vector<PayloadBuffer *> &cache)
+    {
+        Shared &shared = shared_lists();
+        std::lock_guard<std::mutex> lock(shared.mtx);
+        std::vector<PayloadBuffer *> &list = shared.free[cls];
+        while (!list.empty() && cache.size() < THREAD_CACHE / 2)
+        {
+            cache.push_back(list.back());
+            list.pop_back();
+        }
+    }
+};
+
+class Payload
+{
+public:
+    // Room reserved in front of the content for the "[SEQ:n] " tag.
+    static const uint32_t HEADROOM = 24;
+
+    Payload() = default;
+    Payload(const Payload &other) : buf(other.buf)
+    {
+        if (buf)
+            buf->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    Payload(Payload &&other) noexcept : buf(other.buf) { other.buf = nullptr; }
+    Payload &operator=(Payload other) noexcept
+    {
+        std::swap(buf, other.buf);
+        return *this;
+    }
+    ~Payload()
+    {
+        if (buf && buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            PayloadPool::release(buf);
+    }
+
+    // Encode the concatenation of parts into one pooled buffer.
+    static Payload concat(std::initializer_list<std::string_view> parts)
+    {
+        size_t length = 0;
+        for (std::string_view part : parts)
+            length += part.size();
+
+        Payload payload;
+        payload.buf = PayloadPool::acquire(HEADROOM + length + 1);
+        payload.buf->offset = HEADROOM;
+        payload.buf->length = static_cast<uint32_t>(length);
+
+        char *out = payload.buf->bytes() + HEADROOM;
+        for (std::string_view part : parts)
+        {
+            std::memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+        *out = '\0';
+        return payload;
+    }
+
+    // Write prefix into the headroom. Only valid while this is the sole
+    // reference, i.e. before the payload is shared with any recipient.
+    void prepend(std::string_view prefix)
+    {
+        if (prefix.size() > buf->offset)
+            return;
+        buf->offset -= static_cast<uint32_t>(prefix.size());
+        buf->length += static_cast<uint32_t>(prefix.size());
+        std::memcpy(buf->bytes() + buf->offset, prefix.data(), prefix.size());
+    }
+
+    bool empty() const { return !buf; }
+    const char *data() const { return buf->bytes() + buf->offset; }
+    size_t size() const { return buf->length; }
+    std::string_view view() const { return std::string_view(data(), size()); }
+
+private:
+    PayloadBuffer *buf = nullptr;
+};
+
+// ============================================================
+//  BROADCAST TASKS AND QUEUES
+// ============================================================
+
 struct BroadcastTask
 {
-    int sequence_id;             // Task order
-    std::string message_payload; // Content to broadcast
-    std::string sender_name;     // Sender's name
-    std::string target_room;     // Target room (optional)
+    int sequence_id;         // Per-room order, stamped by the room's worker
+    Payload message_payload; // Content to broadcast; the worker adds the [SEQ:n] tag
+    std::string sender_name; // Sender's name
+    std::string target_room; // Target room
+    std::chrono::steady_clock::time_point queued; // set by enqueue_broadcast
+    unsigned priority = PRIO_CHAT; // PRIO_CONTROL for [SYSTEM] notices: control lane, sent ahead of chat
+    std::string blob;        // shm object the message is a handle for, see BlobRegistry
+    size_t blob_bytes = 0;
+};
+
+// What a full TaskQueue does with a new item.
+enum class OverflowPolicy
+{
+    Block,  // wait for a consumer to make room
+    Drop,   // discard the new item
+    Reject  // discard it and tell the producer, so it can notify the sender
+};
+
+enum class PushResult
+{
+    Ok,
+    Dropped,
+    Rejected
 };
 
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov's ring of
+// sequenced cells). Items are moved in and out. The mutex and condition
+// variables are only touched when a consumer has to sleep on an empty queue
+// or a blocking producer on a full one, and notify is skipped when nobody
+// is waiting.
 template <typename T>
 class TaskQueue
 {
 public:
-    void push(T item)
+    explicit TaskQueue(size_t min_capacity = 1024, OverflowPolicy full_policy = OverflowPolicy::Block)
+        : policy(full_policy)
     {
-        std::unique_lock<std::mutex> lock(mtx);
-        queue.push(item);
-        lock.unlock();
-        cv.notify_one();
+        capacity = 1;
+        while (capacity < min_capacity)
+            capacity <<= 1;
+        mask = capacity - 1;
+
+        cells.reset(new Cell[capacity]);
+        for (size_t i = 0; i < capacity; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    PushResult push(T &&item)
+    {
+        while (!try_push(item))
+        {
+            if (policy == OverflowPolicy::Drop)
+            {
+                dropped_count.fetch_add(1, std::memory_order_relaxed);
+                return PushResult::Dropped;
+            }
+            if (policy == OverflowPolicy::Reject)
+            {
+                rejected_count.fetch_add(1, std::memory_order_relaxed);
+                return PushResult::Rejected;
+            }
+            wait_until(producers_waiting, not_full, [this]
+                       { return !full(); });
+        }
+
+        size_t depth = size();
+        size_t mark = high_water_mark.load(std::memory_order_relaxed);
+        while (depth > mark && !high_water_mark.compare_exchange_weak(mark, depth, std::memory_order_relaxed))
+        {
+        }
+
+        wake(consumers_waiting, not_empty);
+        return PushResult::Ok;
     }
 
     T pop()
     {
-        std::unique_lock<std::mutex> lock(mtx);
-        cv.wait(lock, [this]
-                { return !queue.empty(); });
-        T item = queue.front();
-        queue.pop();
+        T item;
+        while (!try_pop(item))
+            wait_until(consumers_waiting, not_empty, [this]
+                       { return !empty(); });
+        wake(producers_waiting, not_full);
         return item;
     }
 
+    // Block until at least one item is available, then take up to max_items
+    // without blocking again. Returns the number appended to out.
+    size_t pop_batch(std::vector<T> &out, size_t max_items)
+    {
+        return pop_batch_until(out, max_items, std::chrono::steady_clock::time_point::max());
+    }
+
+    // Like pop_batch, but gives up at deadline, or on interrupt(), and
+    // returns 0.
+    size_t pop_batch_until(std::vector<T> &out, size_t max_items, std::chrono::steady_clock::time_point deadline)
+    {
+        T item;
+        while (!try_pop(item))
+        {
+            if (interrupted.exchange(false, std::memory_order_acq_rel))
+                return 0;
+            if (!wait_until(consumers_waiting, not_empty, [this]
+                            { return !empty() || interrupted.load(std::memory_order_acquire); }, deadline))
+                return 0;
+        }
+        out.push_back(std::move(item));
+        size_t count = 1 + take_more(out, max_items - 1);
+        wake(producers_waiting, not_full);
+        return count;
+    }
+
+    // Whatever is there, up to max_items, without waiting.
+    size_t try_pop_batch(std::vector<T> &out, size_t max_items)
+    {
+        size_t count = take_more(out, max_items);
+        if (count > 0)
+            wake(producers_waiting, not_full);
+        return count;
+    }
+
+    // Make a consumer blocked in pop_batch return 0 without an item, so a
+    // thread sleeping on this queue notices work that arrived elsewhere
+    // (the broadcaster's control lane). Sticky until a pop sees it.
+    void interrupt()
+    {
+        interrupted.store(true, std::memory_order_release);
+        wake(consumers_waiting, not_empty);
+    }
+
+    size_t size() const
+    {
+        size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t high_water() const { return high_water_mark.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_count.load(std::memory_order_relaxed); }
+    uint64_t rejected() const { return rejected_count.load(std::memory_order_relaxed); }
+
 private:
-    std::queue<T> queue;
+    struct alignas(64) Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    size_t take_more(std::vector<T> &out, size_t max_items)
+    {
+        T item;
+        size_t count = 0;
+        while (count < max_items && try_pop(item))
+        {
+            out.push_back(std::move(item));
+            count++;
+        }
+        return count;
+    }
+
+    bool try_push(T &item)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.data = std::move(item);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T &item)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    item = std::move(cell.data);
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // empty
+            }
+            else
+            {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool empty() const
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_seq_cst);
+        return cells[pos & mask].sequence.load(std::memory_order_seq_cst) != pos + 1;
+    }
+
+    bool full() const
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_seq_cst);
+        return cells[pos & mask].sequence.load(std::memory_order_seq_cst) != pos;
+    }
+
+    // The waiter registers itself before re-checking the condition and the
+    // waker publishes before reading the waiter count; the seq_cst fences
+    // guarantee at least one of them sees the other.
+    // Returns false if the deadline passed first.
+    template <typename Pred>
+    bool wait_until(std::atomic<int> &waiters, std::condition_variable &cv, Pred ready,
+                    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+    {
+        for (int spin = 0; spin < 64; ++spin)
+        {
+            if (ready())
+                return true;
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(mtx);
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool ok = true;
+        if (deadline == std::chrono::steady_clock::time_point::max())
+            cv.wait(lock, ready);
+        else
+            ok = cv.wait_until(lock, deadline, ready);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return ok;
+    }
+
+    void wake(std::atomic<int> &waiters, std::condition_variable &cv)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_seq_cst) == 0)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        cv.notify_all();
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    size_t capacity;
+    size_t mask;
+    OverflowPolicy policy;
+
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+    alignas(64) std::atomic<size_t> high_water_mark{0};
+    std::atomic<uint64_t> dropped_count{0};
+    std::atomic<uint64_t> rejected_count{0};
+
     std::mutex mtx;
-    std::condition_variable cv;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::atomic<int> consumers_waiting{0};
+    std::atomic<int> producers_waiting{0};
+    std::atomic<bool> interrupted{false};
 };
 
 class WriteLock
@@ -80,413 +559,4941 @@ private:
 };
 
 // ============================================================
-//  GLOBAL VARIABLES
+//  ASYNC LOGGER
 // ============================================================
+//
+// Handlers and workers never write to stdout themselves: a log line is
+// formatted by the caller, pushed onto a queue and written by one logger
+// thread. The queue drops lines rather than block when stdout can't keep
+// up, and lines above the configured --log-level are never formatted.
 
-std::map<std::string, std::vector<std::string>> room_members = {
-    {"room1", {}}, {"room2", {}}, {"room3", {}}};
+enum class LogLevel
+{
+    Error,
+    Warn,
+    Info,
+    Debug
+};
 
-pthread_rwlock_t registry_lock;
-TaskQueue<BroadcastTask> broadcast_queue;
-std::vector<std::string> client_queues;
+class AsyncLogger
+{
+public:
+    void start(LogLevel max_level)
+    {
+        level = max_level;
+        std::thread(&AsyncLogger::run, this).detach();
+    }
+
+    bool enabled(LogLevel at) const { return at <= level; }
+
+    template <typename... Args>
+    void write(LogLevel at, const Args &...args)
+    {
+        if (!enabled(at))
+            return;
+        std::ostringstream line;
+        (line << ... << args);
+        line << '\n';
+        lines.push(line.str());
+    }
+
+    uint64_t dropped() const { return lines.dropped(); }
+    size_t backlog() const { return lines.size(); }
+
+    // Give the logger thread up to a second to write what is queued, before
+    // the process exits.
+    void drain()
+    {
+        for (int i = 0; i < 100 && lines.size() > 0; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+private:
+    void run()
+    {
+        std::vector<std::string> batch;
+        while (true)
+        {
+            batch.clear();
+            lines.pop_batch(batch, 256);
+            for (const std::string &line : batch)
+                std::fwrite(line.data(), 1, line.size(), stdout);
+            std::fflush(stdout);
+        }
+    }
+
+    LogLevel level = LogLevel::Info;
+    TaskQueue<std::string> lines{8192, OverflowPolicy::Drop};
+};
+
+AsyncLogger logger;
+
+template <typename... Args>
+void log_error(const Args &...args) { logger.write(LogLevel::Error, args...); }
+template <typename... Args>
+void log_warn(const Args &...args) { logger.write(LogLevel::Warn, args...); }
+template <typename... Args>
+void log_info(const Args &...args) { logger.write(LogLevel::Info, args...); }
+template <typename... Args>
+void log_debug(const Args &...args) { logger.write(LogLevel::Debug, args...); }
+
+// ============================================================
+//  CLIENT QUEUE DESCRIPTOR CACHE
+// ============================================================
+
+// What happens when a client's queue is full (mq_send returns EAGAIN).
+enum class ClientOverflow
+{
+    DropNewest, // lose the message being sent
+    DropOldest, // pull the oldest message out of the client's queue to make room
+    Spill       // park it in the egress reactor until the queue drains
+};
+
+// Token bucket of burst tokens refilled one per interval, kept as GCRA: a
+// single "theoretical arrival time" that each admitted message pushes one
+// interval further out. A message is admitted while that time is less than
+// burst intervals ahead of now. One atomic, so concurrent ingest threads
+// need no lock.
+class TokenBucket
+{
+public:
+    bool take(int64_t now_ns, int64_t interval_ns, int64_t burst)
+    {
+        int64_t current = tat.load(std::memory_order_relaxed);
+        while (true)
+        {
+            int64_t base = std::max(current, now_ns);
+            if (base - now_ns > (burst - 1) * interval_ns)
+                return false;
+            if (tat.compare_exchange_weak(current, base + interval_ns, std::memory_order_relaxed))
+                return true;
+        }
+    }
 
-std::map<std::string, std::chrono::steady_clock::time_point> client_heartbeats;
-std::mutex heartbeat_mutex;
+private:
+    std::atomic<int64_t> tat{0};
+};
+
+// A message waiting in a client's pending-output queue.
+struct PendingMessage
+{
+    std::string bytes;
+    std::chrono::steady_clock::time_point queued;
+    unsigned priority;
+};
+
+// An open write descriptor to one client's queue. The descriptor is closed
+// when the last thread holding the handle lets go of it, so a broadcaster
+// that is mid-send never races with handle_quit closing it underneath.
+struct ClientHandle : std::enable_shared_from_this<ClientHandle>
+{
+    std::string name;
+    mqd_t mqd;
+    uint32_t caps = 0; // ClientCaps announced at REGISTER
+    ClientOverflow overflow = ClientOverflow::DropNewest;
+
+    // Serialises sends for DropOldest / Spill clients so that pending
+    // messages go out before newer ones.
+    std::mutex send_mtx;
+    std::deque<PendingMessage> pending;
+    bool parked = false;  // mqd is watched by the egress reactor (under send_mtx)
+    mqd_t drain_mqd = -1; // read side of the client's queue, for DropOldest
+
+    std::atomic<size_t> pending_bytes{0};
+    std::atomic<bool> retired{false}; // dropped from the cache on QUIT / timeout
+
+    std::atomic<int64_t> last_seen_ms{0}; // steady clock, any inbound message
+    std::atomic<bool> in_wheel{false};    // has an entry in the heartbeat wheel
+
+    // CAP_SHM clients: deliveries go into this ring instead of mqd.
+    // ring_mtx makes the server's many writers a single producer.
+    std::unique_ptr<ShmRing> ring;
+    std::mutex ring_mtx;
+
+    std::atomic<uint64_t> dropped_newest{0};
+    std::atomic<uint64_t> dropped_oldest{0};
+    std::atomic<uint64_t> spilled{0};
+    std::atomic<uint64_t> redelivered{0};
+
+    // Admission control for SAY / DM (see ADMISSION CONTROL)
+    TokenBucket chat_tokens;
+    std::atomic<uint64_t> refused{0};
+    std::atomic<uint64_t> refused_unreported{0}; // since the last notice
+    std::atomic<int64_t> next_notice_ms{0};
+
+    ClientHandle(const std::string &client_name, mqd_t q) : name(client_name), mqd(q) {}
+    ~ClientHandle()
+    {
+        mq_close(mqd);
+        if (drain_mqd != -1)
+            mq_close(drain_mqd);
+    }
+};
+
+class ClientQueueCache
+{
+public:
+    ClientQueueCache() { pthread_rwlock_init(&lock, NULL); }
+    ~ClientQueueCache() { pthread_rwlock_destroy(&lock); }
+
+    // Called from handle_register: (re)open the client's queue and replace
+    // any stale entry left by a previous session with the same name.
+    std::shared_ptr<ClientHandle> open(const std::string &client_name, uint32_t caps, ClientOverflow overflow)
+    {
+        std::shared_ptr<ClientHandle> handle = open_queue(client_name);
+        if (handle && (caps & CAP_SHM))
+        {
+            handle->ring.reset(new ShmRing());
+            if (!handle->ring->attach(ring_name(client_name)))
+            {
+                log_warn("[SYSTEM] cannot map ", ring_name(client_name), ", ", client_name,
+                         " stays on its message queue.");
+                handle->ring.reset();
+                caps &= ~CAP_SHM;
+            }
+        }
 
-std::atomic<int> global_sequence_id(0);
+        WriteLock w(lock);
+        if (handle)
+        {
+            handle->caps = caps;
+            handle->overflow = overflow;
+        }
+        auto it = table.find(client_name);
+        if (it != table.end())
+        {
+            it->second->retired = true; // same as invalidate(): the old session is over
+            if (handle)
+                it->second = handle;
+            else
+                table.erase(it);
+        }
+        else if (handle)
+            table.emplace(client_name, handle);
+        return handle;
+    }
+
+    // Look up the cached descriptor, opening it only on a miss.
+    // Returns nullptr if the client's queue does not exist.
+    std::shared_ptr<ClientHandle> get(const std::string &client_name)
+    {
+        {
+            ReadLock r(lock);
+            auto it = table.find(client_name);
+            if (it != table.end())
+            {
+                reused_count.fetch_add(1, std::memory_order_relaxed);
+                return it->second;
+            }
+        }
+
+        std::shared_ptr<ClientHandle> handle = open_queue(client_name);
+        if (!handle)
+            return nullptr;
+
+        WriteLock w(lock);
+        auto inserted = table.emplace(client_name, handle);
+        return inserted.first->second; // another thread may have won the race
+    }
+
+    // Cached handle only: never opens a queue and does not count as reuse.
+    std::shared_ptr<ClientHandle> find(const std::string &client_name)
+    {
+        ReadLock r(lock);
+        auto it = table.find(client_name);
+        return it == table.end() ? nullptr : it->second;
+    }
+
+    // Called on QUIT and heartbeat timeout. Threads still holding the handle
+    // finish their send; the descriptor closes once they drop it.
+    void invalidate(const std::string &client_name)
+    {
+        WriteLock w(lock);
+        auto it = table.find(client_name);
+        if (it == table.end())
+            return;
+        it->second->retired = true;
+        table.erase(it);
+    }
+
+    // Snapshot of every cached handle, for background sweeps.
+    std::vector<std::shared_ptr<ClientHandle>> snapshot()
+    {
+        ReadLock r(lock);
+        std::vector<std::shared_ptr<ClientHandle>> handles;
+        handles.reserve(table.size());
+        for (auto &entry : table)
+            handles.push_back(entry.second);
+        return handles;
+    }
+
+    ClientOverflow default_overflow = ClientOverflow::Spill; // for queues opened on a cache miss
+
+    uint64_t reused() const { return reused_count.load(std::memory_order_relaxed); }
+    uint64_t reopened() const { return reopened_count.load(std::memory_order_relaxed); }
+
+private:
+    std::shared_ptr<ClientHandle> open_queue(const std::string &client_name)
+    {
+        std::string qname = "/client_" + client_name;
+        mqd_t q = mq_open(qname.c_str(), O_WRONLY | O_NONBLOCK);
+        if (q == -1)
+            return nullptr;
+        reopened_count.fetch_add(1, std::memory_order_relaxed);
+        auto handle = std::make_shared<ClientHandle>(client_name, q);
+        handle->overflow = default_overflow;
+        return handle;
+    }
+
+    std::unordered_map<std::string, std::shared_ptr<ClientHandle>> table;
+    pthread_rwlock_t lock;
+    std::atomic<uint64_t> reused_count{0};
+    std::atomic<uint64_t> reopened_count{0};
+};
+
+// ============================================================
+//  ALLOCATION COUNTING (build with -DCHAT_COUNT_ALLOCS)
+// ============================================================
+
+std::atomic<uint64_t> broadcast_count{0}; // tasks fanned out by broadcaster workers
+std::atomic<bool> shutdown_requested{false}; // set by SIGINT / SIGTERM
+
+#ifdef CHAT_COUNT_ALLOCS
+std::atomic<uint64_t> allocation_count{0};
+
+// noinline: once inlined into callers, GCC sees malloc()/free() where it
+// expects new/delete and warns about mismatched pairs
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { std::free(p); }
+#endif
+
+// ============================================================
+//  SERVER CONFIGURATION
+// ============================================================
+
+struct ServerConfig
+{
+    size_t queue_capacity = 4096; // per broadcaster shard, rounded up to a power of two
+    OverflowPolicy queue_policy = OverflowPolicy::Block;
+    size_t broadcast_batch = 32; // tasks a worker takes per pop
+    int ingest_queues = 1;        // /server_0 .. /server_<N-1>, each with its own receiver
+    int batch_linger_us = 0;      // how long a broadcaster holds a partial batch
+    int broadcast_workers = 0;     // most pool workers, 0 = one per core
+    int broadcast_min_workers = 1; // the pool never shrinks below this
+    bool pin_broadcasters = false; // pin pool worker i to CPU i % cores
+    size_t batch_bytes = 1024;    // largest batched mq message, at most mq_msgsize
+
+    long mq_maxmsg = 10;    // depth of the server's ingest queues
+    long mq_msgsize = 1024; // message size of every queue; clients follow the server
+
+    ClientOverflow client_overflow = ClientOverflow::Spill; // default for clients that don't ask
+    size_t spill_limit = 4096;                              // pending messages held per client
+
+    std::string log_dir;                    // per-room message logs; empty disables history
+    size_t log_segment_bytes = 16u << 20;   // size of one mmapped log segment
+    int log_fsync_ms = 50;                  // group commit interval, 0 = after every batch
+
+    size_t search_limit = 20; // SEARCH results returned, newest first
+
+    double rate_limit = 0;  // SAY + DM per second per client, 0 = unlimited
+    size_t rate_burst = 20; // how many of them may come back to back
+    size_t admit_depth = 0; // refuse SAY while the room's broadcast queue is this deep, 0 = never
+
+    size_t dm_mailbox = 64; // DMs waiting per recipient before senders are refused
+    int dm_hold_ms = 30000; // how long DMs wait for a client that quit or timed out, 0 = not at all
+
+    int blob_ttl_s = 600; // blobs still held after this long are unlinked anyway, 0 = never
+
+    std::string capture_path; // record every inbound message here for ./test replay; empty disables
+
+    int heartbeat_timeout_s = 30;    // silence before a client is dropped (clients ping every 10 s)
+    int heartbeat_sweep_ms = 1000;   // timing wheel tick
+    int stats_interval_s = 60;       // how often [STATS] is printed
+    int stats_page_ms = 1000;        // how often the shared-memory stats page is rewritten, 0 = never
+
+    LogLevel log_level = LogLevel::Info;
+};
+
+bool parse_client_overflow(const std::string &value, ClientOverflow &out)
+{
+    if (value == "drop-newest")
+        out = ClientOverflow::DropNewest;
+    else if (value == "drop-oldest")
+        out = ClientOverflow::DropOldest;
+    else if (value == "spill")
+        out = ClientOverflow::Spill;
+    else
+        return false;
+    return true;
+}
+
+const char *client_overflow_name(ClientOverflow policy)
+{
+    switch (policy)
+    {
+    case ClientOverflow::DropOldest:
+        return "drop-oldest";
+    case ClientOverflow::Spill:
+        return "spill";
+    default:
+        return "drop-newest";
+    }
+}
+
+bool load_config_file(const std::string &path, ServerConfig &config);
+
+// Apply one setting. Keys are the command-line flags without the leading
+// "--", which is also the syntax of the config file.
+bool apply_server_option(const std::string &key, const std::string &value, ServerConfig &config)
+{
+    try
+    {
+        if (key == "queue-capacity")
+            config.queue_capacity = std::stoul(value);
+        else if (key == "broadcast-batch")
+            config.broadcast_batch = std::max<size_t>(1, std::stoul(value));
+        else if (key == "batch-linger-us")
+            config.batch_linger_us = std::max(0, std::stoi(value));
+        else if (key == "broadcast-workers")
+            config.broadcast_workers = std::max(0, std::stoi(value));
+        else if (key == "broadcast-min-workers")
+            config.broadcast_min_workers = std::max(1, std::stoi(value));
+        else if (key == "pin-broadcasters")
+            config.pin_broadcasters = std::stoi(value) != 0;
+        else if (key == "batch-bytes")
+            config.batch_bytes = std::stoul(value);
+        else if (key == "ingest-queues")
+            config.ingest_queues = std::min(std::max(1, std::stoi(value)), MAX_INGEST_QUEUES);
+        else if (key == "mq-maxmsg")
+            config.mq_maxmsg = std::max(1L, std::stol(value));
+        else if (key == "mq-msgsize")
+            config.mq_msgsize = std::max(128L, std::stol(value));
+        else if (key == "spill-limit")
+            config.spill_limit = std::stoul(value);
+        else if (key == "log-dir")
+            config.log_dir = value;
+        else if (key == "log-segment-mb")
+            config.log_segment_bytes = std::max(1UL, std::stoul(value)) << 20;
+        else if (key == "log-fsync-ms")
+            config.log_fsync_ms = std::max(0, std::stoi(value));
+        else if (key == "search-limit")
+            config.search_limit = std::max(1UL, std::stoul(value));
+        else if (key == "capture")
+            config.capture_path = value;
+        else if (key == "rate-limit")
+            config.rate_limit = std::max(0.0, std::stod(value));
+        else if (key == "rate-burst")
+            config.rate_burst = std::max(1UL, std::stoul(value));
+        else if (key == "admit-depth")
+            config.admit_depth = std::stoul(value);
+        else if (key == "dm-mailbox")
+            config.dm_mailbox = std::max(1UL, std::stoul(value));
+        else if (key == "dm-hold-ms")
+            config.dm_hold_ms = std::max(0, std::stoi(value));
+        else if (key == "blob-ttl")
+            config.blob_ttl_s = std::max(0, std::stoi(value));
+        else if (key == "heartbeat-timeout")
+            config.heartbeat_timeout_s = std::max(1, std::stoi(value));
+        else if (key == "heartbeat-sweep-ms")
+            config.heartbeat_sweep_ms = std::max(10, std::stoi(value));
+        else if (key == "stats-interval")
+            config.stats_interval_s = std::max(1, std::stoi(value));
+        else if (key == "stats-page-ms")
+            config.stats_page_ms = std::max(0, std::stoi(value));
+        else if (key == "log-level")
+        {
+            if (value == "error")
+                config.log_level = LogLevel::Error;
+            else if (value == "warn")
+                config.log_level = LogLevel::Warn;
+            else if (value == "info")
+                config.log_level = LogLevel::Info;
+            else if (value == "debug")
+                config.log_level = LogLevel::Debug;
+            else
+            {
+                std::cerr << "Unknown log level: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (key == "client-overflow")
+        {
+            if (!parse_client_overflow(value, config.client_overflow))
+            {
+                std::cerr << "Unknown client overflow policy: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (key == "queue-policy")
+        {
+            if (value == "block")
+                config.queue_policy = OverflowPolicy::Block;
+            else if (value == "drop")
+                config.queue_policy = OverflowPolicy::Drop;
+            else if (value == "reject")
+                config.queue_policy = OverflowPolicy::Reject;
+            else
+            {
+                std::cerr << "Unknown queue policy: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (key == "config")
+            return load_config_file(value, config);
+        else
+        {
+            std::cerr << "Unknown option: " << key << std::endl;
+            return false;
+        }
+    }
+    catch (const std::exception &)
+    {
+        std::cerr << "Bad value for " << key << ": " << value << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// "key = value" per line; blank lines and lines starting with '#' are skipped.
+bool load_config_file(const std::string &path, ServerConfig &config)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Cannot read config file " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        auto trim = [](std::string text)
+        {
+            size_t begin = text.find_first_not_of(" \t\r");
+            size_t end = text.find_last_not_of(" \t\r");
+            return begin == std::string::npos ? std::string() : text.substr(begin, end - begin + 1);
+        };
+
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+        {
+            std::cerr << path << ": expected key = value: " << line << std::endl;
+            return false;
+        }
+        if (!apply_server_option(trim(line.substr(0, eq)), trim(line.substr(eq + 1)), config))
+            return false;
+    }
+    return true;
+}
+
+// Parse --flag value pairs. Returns false on an unknown flag or bad value.
+bool parse_server_args(int argc, char *argv[], ServerConfig &config)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            std::cerr << "Unexpected argument: " << arg << std::endl;
+            return false;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        if (!apply_server_option(arg.substr(2), argv[++i], config))
+            return false;
+    }
+    return true;
+}
+
+// Read one of /proc/sys/fs/mqueue/*; returns -1 if it is not available.
+long read_mqueue_limit(const char *name)
+{
+    std::ifstream in(std::string("/proc/sys/fs/mqueue/") + name);
+    long value = -1;
+    if (!(in >> value))
+        return -1;
+    return value;
+}
+
+// Clamp the queue geometry to what the kernel will let us create, so a
+// config written for a tuned host still starts on a default one.
+void clamp_to_kernel_limits(ServerConfig &config)
+{
+    long msg_max = read_mqueue_limit("msg_max");
+    long msgsize_max = read_mqueue_limit("msgsize_max");
+    long queues_max = read_mqueue_limit("queues_max");
+
+    if (msg_max > 0 && config.mq_maxmsg > msg_max)
+    {
+        log_warn("[CONFIG] mq-maxmsg ", config.mq_maxmsg, " exceeds fs.mqueue.msg_max, using ", msg_max);
+        config.mq_maxmsg = msg_max;
+    }
+    if (msgsize_max > 0 && config.mq_msgsize > msgsize_max)
+    {
+        log_warn("[CONFIG] mq-msgsize ", config.mq_msgsize, " exceeds fs.mqueue.msgsize_max, using ", msgsize_max);
+        config.mq_msgsize = msgsize_max;
+    }
+    if (queues_max > 0 && config.ingest_queues + 1 > queues_max)
+    {
+        log_warn("[CONFIG] ingest-queues ", config.ingest_queues, " exceeds fs.mqueue.queues_max, using ", queues_max - 1);
+        config.ingest_queues = std::max(1L, queues_max - 1);
+    }
+    if (config.batch_bytes > static_cast<size_t>(config.mq_msgsize))
+        config.batch_bytes = config.mq_msgsize;
+
+    if (queues_max > 0)
+        log_info("[CONFIG] queue geometry: maxmsg=", config.mq_maxmsg, " msgsize=", config.mq_msgsize,
+                 " (kernel allows ", queues_max, " queues per user)");
+    else
+        log_info("[CONFIG] queue geometry: maxmsg=", config.mq_maxmsg, " msgsize=", config.mq_msgsize);
+}
+
+// ============================================================
+//  CLIENT SLOTS AND MEMBER BITMAPS
+// ============================================================
+//
+// Every client that registers (or joins without registering) gets a dense
+// slot number, the lowest one free, and gives it back when it quits. A
+// room's members are a bitmap over slots, so a fan-out walks the set bits
+// and goes straight from slot to queue handle, with no per-member string
+// hashing. A client may be in any number of rooms (see CAP_ROOMS).
+
+class MemberBitmap
+{
+public:
+    // Both return false if the bit was already in that state.
+    bool set(uint32_t slot)
+    {
+        size_t word = slot / 64;
+        if (word >= words.size())
+            words.resize(word + 1, 0);
+        uint64_t bit = 1ull << (slot % 64);
+        if (words[word] & bit)
+            return false;
+        words[word] |= bit;
+        count++;
+        return true;
+    }
+
+    bool clear(uint32_t slot)
+    {
+        size_t word = slot / 64;
+        uint64_t bit = 1ull << (slot % 64);
+        if (word >= words.size() || !(words[word] & bit))
+            return false;
+        words[word] &= ~bit;
+        count--;
+        return true;
+    }
+
+    bool test(uint32_t slot) const
+    {
+        size_t word = slot / 64;
+        return word < words.size() && (words[word] & (1ull << (slot % 64)));
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // fn(slot) for every member, lowest slot first
+    template <typename Fn>
+    void for_each(Fn fn) const
+    {
+        for (size_t word = 0; word < words.size(); ++word)
+            for (uint64_t bits = words[word]; bits; bits &= bits - 1)
+                fn(static_cast<uint32_t>(word * 64 + __builtin_ctzll(bits)));
+    }
+
+private:
+    std::vector<uint64_t> words;
+    size_t count = 0;
+};
+
+struct ClientSlot
+{
+    std::string name;                     // empty while the slot is free
+    std::shared_ptr<ClientHandle> handle; // set on REGISTER; null for clients that never registered
+    std::vector<std::string> rooms;       // in the order they were joined
+    std::string current;                  // where a SAY without a room goes
+};
+
+class ClientDirectory
+{
+public:
+    // The client's slot, allocating one if it has none.
+    uint32_t acquire(const std::string &name)
+    {
+        auto it = index.find(name);
+        if (it != index.end())
+            return it->second;
+
+        uint32_t slot;
+        if (free_slots.empty())
+        {
+            slot = static_cast<uint32_t>(slots.size());
+            slots.emplace_back();
+        }
+        else
+        {
+            slot = free_slots.top();
+            free_slots.pop();
+        }
+        slots[slot].name = name;
+        index.emplace(name, slot);
+        return slot;
+    }
+
+    // -1 if the client has no slot.
+    int find(const std::string &name) const
+    {
+        auto it = index.find(name);
+        return it == index.end() ? -1 : static_cast<int>(it->second);
+    }
+
+    ClientSlot *entry(const std::string &name)
+    {
+        int slot = find(name);
+        return slot < 0 ? nullptr : &slots[slot];
+    }
+
+    const ClientSlot *entry(const std::string &name) const
+    {
+        int slot = find(name);
+        return slot < 0 ? nullptr : &slots[slot];
+    }
+
+    const ClientSlot &at(uint32_t slot) const { return slots[slot]; }
+
+    // The client must already have left every room.
+    void release(const std::string &name)
+    {
+        auto it = index.find(name);
+        if (it == index.end())
+            return;
+        slots[it->second] = ClientSlot();
+        free_slots.push(it->second);
+        index.erase(it);
+    }
+
+    size_t size() const { return index.size(); }
+    size_t capacity() const { return slots.size(); }
+
+private:
+    std::unordered_map<std::string, uint32_t> index;
+    std::vector<ClientSlot> slots;
+    std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>> free_slots; // lowest first
+};
+
+// ============================================================
+//  GLOBAL VARIABLES
+// ============================================================
+
+ServerConfig server_config;
+
+// Room membership as member bitmaps, and each client's slot with the rooms
+// it is in. Both are guarded by registry_lock and always updated together.
+std::unordered_map<std::string, MemberBitmap> room_members = {
+    {"room1", {}}, {"room2", {}}, {"room3", {}}};
+ClientDirectory client_directory;
+
+// id -> name for binary frames (see protocol.h), guarded by registry_lock
+std::unordered_map<uint32_t, std::string> client_ids;
+std::unordered_map<uint32_t, std::string> room_ids;
+
+pthread_rwlock_t registry_lock;
+
+// Writers (REGISTER, JOIN, LEAVE, QUIT) are preferred: with glibc's default
+// a steady stream of readers can keep them waiting indefinitely. Nothing
+// takes the read lock recursively, which this kind requires.
+void init_registry_lock()
+{
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&registry_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+// Broadcast work is partitioned by room: every room hashes to one shard and
+// a shard is run by at most one worker at a time, so a room's messages leave
+// in the order they were queued and its sequence counter needs no
+// synchronisation. Workers are not tied to shards: a shard that gets work is
+// put on ready_shards once, and any worker of the pool (see BROADCASTER
+// POOL) may take it.
+//
+// A shard has two lanes. [SYSTEM] notices go in the control lane, which the
+// worker empties before every batch of chat, so they never wait behind a
+// fan-out backlog. A full control lane blocks the handler queueing the
+// notice until a worker drains it, and workers take registry_lock to do
+// that, so handlers must enqueue only after releasing registry_lock.
+struct BroadcastShard
+{
+    BroadcastShard(size_t capacity, OverflowPolicy policy) : chat(capacity, policy) {}
+
+    TaskQueue<BroadcastTask> control{1024, OverflowPolicy::Block};
+    TaskQueue<BroadcastTask> chat;
+    std::atomic<bool> scheduled{false};       // on ready_shards or held by a worker
+    std::atomic<int64_t> ready_since_ns{0};   // when it was last put on ready_shards
+
+    bool idle() const { return control.size() == 0 && chat.size() == 0; }
+};
+
+const int NUM_BROADCAST_SHARDS = 16;
+std::unique_ptr<BroadcastShard> broadcast_shards[NUM_BROADCAST_SHARDS];
+
+// Shards waiting for a worker; -1 tells the worker that takes it to exit.
+// Each shard is on it at most once and there is at most one -1 per worker.
+TaskQueue<int> ready_shards(2 * NUM_BROADCAST_SHARDS);
+std::unordered_set<std::string> client_queues;
+
+ClientQueueCache client_handles;
+
+// ============================================================
+//  METRICS
+// ============================================================
+//
+// Every thread that records a metric gets its own ThreadMetrics block,
+// registered on first use and never freed, so recording is a relaxed store
+// to memory no other thread writes. When a thread exits its block is handed
+// to the next thread that registers, which keeps counting in it. STATS, the [STATS] lines and the
+// shared-memory stats page merge the blocks when they read them.
+
+// Log-linear histogram: values below 8 get a bucket each, and every power
+// of two above that is split into 8 linear sub-buckets, so a quantile is
+// within 12.5% of the true value at any scale. Latencies are recorded in
+// nanoseconds. Only one thread records into a given histogram.
+class Histogram
+{
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static int bucket_of(uint64_t value)
+    {
+        if (value < SUB_BUCKETS)
+            return static_cast<int>(value);
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Largest value that lands in bucket i.
+    static uint64_t bucket_high(int i)
+    {
+        if (i < SUB_BUCKETS)
+            return i;
+        int shift = i / SUB_BUCKETS - 1;
+        uint64_t low = static_cast<uint64_t>(SUB_BUCKETS + i % SUB_BUCKETS) << shift;
+        return low + ((1ull << shift) - 1);
+    }
+
+    void record(uint64_t value)
+    {
+        bump(buckets[bucket_of(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+        if (value > peak.load(std::memory_order_relaxed))
+            peak.store(value, std::memory_order_relaxed);
+    }
+
+    void record(std::chrono::steady_clock::duration elapsed)
+    {
+        record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+
+    // Add another thread's histogram into this one (a reader's private copy).
+    void merge(const Histogram &other)
+    {
+        if (other.count() == 0)
+            return;
+        for (int i = 0; i < BUCKETS; ++i)
+            bump(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+        bump(total, other.count());
+        bump(sum, other.sum.load(std::memory_order_relaxed));
+        peak.store(std::max(max(), other.max()), std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the given quantile.
+    uint64_t quantile(double q) const
+    {
+        uint64_t rank = static_cast<uint64_t>(q * count());
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen > rank)
+                return std::min(bucket_high(i), max());
+        }
+        return max();
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return peak.load(std::memory_order_relaxed); }
+    double mean() const { return count() ? double(sum.load(std::memory_order_relaxed)) / count() : 0; }
+
+private:
+    static void bump(std::atomic<uint64_t> &counter, uint64_t by)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> buckets[BUCKETS] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> peak{0};
+};
+
+enum Metric
+{
+    M_QUEUE_WAIT,    // broadcast task, enqueue to worker pop (ns)
+    M_QUEUE_DEPTH,   // tasks still in the shard queue after each pop
+    M_SHARD_WAIT,    // shard put on ready_shards until claimed by a pool worker (ns)
+    M_FANOUT,        // recipients of each broadcast message
+    M_FLUSH_LATENCY, // time a spilled message stayed parked (ns)
+    M_SEARCH,        // SEARCH query time (ns)
+    M_DM_WAIT,       // DM, receive to the recipient's queue (ns)
+    M_HANDLER,       // + opcode: handler run time (ns); + 0 counts unknown commands
+    M_COUNT = M_HANDLER + OP_COUNT
+};
+
+const char *const handler_names[OP_COUNT] = {
+    "unknown", "REGISTER", "JOIN", "SAY", "DM", "WHO", "LEAVE", "QUIT", "PING", "SEARCH", "STATS", "RELEASE"};
+
+// Client send failures are counted by errno; anything past the table lands
+// in the last slot.
+const int SEND_ERRNO_SLOTS = 160;
+
+struct ThreadMetrics
+{
+    Histogram histograms[M_COUNT];
+    std::atomic<uint64_t> send_errors[SEND_ERRNO_SLOTS] = {};
+};
+
+class MetricsRegistry
+{
+public:
+    ThreadMetrics &local()
+    {
+        thread_local Lease mine(*this);
+        return *mine.block;
+    }
+
+    void merged(Metric metric, Histogram &out)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (const std::unique_ptr<ThreadMetrics> &thread : threads)
+            out.merge(thread->histograms[metric]);
+    }
+
+    // (errno, failures) for every errno seen, lowest first
+    std::vector<std::pair<int, uint64_t>> send_errors()
+    {
+        std::vector<std::pair<int, uint64_t>> errors;
+        std::lock_guard<std::mutex> lock(mtx);
+        for (int err = 0; err < SEND_ERRNO_SLOTS; ++err)
+        {
+            uint64_t failures = 0;
+            for (const std::unique_ptr<ThreadMetrics> &thread : threads)
+                failures += thread->send_errors[err].load(std::memory_order_relaxed);
+            if (failures)
+                errors.emplace_back(err, failures);
+        }
+        return errors;
+    }
+
+private:
+    struct Lease
+    {
+        explicit Lease(MetricsRegistry &owner) : registry(owner), block(owner.attach()) {}
+        ~Lease() { registry.detach(block); }
+
+        MetricsRegistry &registry;
+        ThreadMetrics *block;
+    };
+
+    ThreadMetrics *attach()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!unused.empty())
+        {
+            ThreadMetrics *block = unused.back();
+            unused.pop_back();
+            return block;
+        }
+        threads.emplace_back(new ThreadMetrics());
+        return threads.back().get();
+    }
+
+    void detach(ThreadMetrics *block)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        unused.push_back(block);
+    }
+
+    std::mutex mtx;
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;
+    std::vector<ThreadMetrics *> unused; // blocks of threads that have exited
+};
+
+MetricsRegistry metrics;
+
+void record_metric(Metric metric, uint64_t value)
+{
+    metrics.local().histograms[metric].record(value);
+}
+
+void record_metric(Metric metric, std::chrono::steady_clock::duration elapsed)
+{
+    metrics.local().histograms[metric].record(elapsed);
+}
+
+void count_send_error(int err)
+{
+    std::atomic<uint64_t> &slot = metrics.local().send_errors[std::min(std::max(err, 0), SEND_ERRNO_SLOTS - 1)];
+    slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+const char *errno_name(int err)
+{
+    switch (err)
+    {
+    case EAGAIN:
+        return "EAGAIN";
+    case EMSGSIZE:
+        return "EMSGSIZE";
+    case EBADF:
+        return "EBADF";
+    case EINTR:
+        return "EINTR";
+    case EINVAL:
+        return "EINVAL";
+    case ETIMEDOUT:
+        return "ETIMEDOUT";
+    case EPROTO:
+        return "EPROTO";
+    default:
+        return nullptr;
+    }
+}
+
+// ============================================================
+//  MESSAGE LOG
+// ============================================================
+//
+// With --log-dir every room message is appended, after its [SEQ:n] tag is
+// stamped, to <log-dir>/<room>/<first seq>.log. A segment is a
+// preallocated, mmapped file of [uint32 length][uint32 seq][bytes] records;
+// a zero length marks the end. Sequence numbers in a room are dense, so the
+// index of a segment is just the offset of each record by seq - first_seq,
+// rebuilt by scanning the segments when a room is first opened.
+//
+// Broadcasters hand records to a single writer thread through a TaskQueue
+// (sharing the payload, not copying it). The writer appends a batch at a
+// time and msyncs what it wrote at most every --log-fsync-ms.
+
+struct LogRecord
+{
+    std::string room;
+    int seq;
+    Payload payload;
+};
+
+struct LogSegment
+{
+    int first_seq;
+    int fd = -1;
+    char *base = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t synced = 0;
+    std::vector<uint32_t> offsets; // offsets[i] is the record with seq first_seq + i
+
+    ~LogSegment()
+    {
+        if (base)
+            munmap(base, capacity);
+        if (fd != -1)
+            close(fd);
+    }
+};
+
+class RoomLog
+{
+public:
+    explicit RoomLog(const std::string &directory) : dir(directory) {}
+
+    // Map the existing segments, oldest first.
+    void load()
+    {
+        std::vector<int> firsts;
+        if (DIR *d = opendir(dir.c_str()))
+        {
+            while (struct dirent *entry = readdir(d))
+            {
+                int first;
+                char suffix[8];
+                if (std::sscanf(entry->d_name, "%d.%7s", &first, suffix) == 2 && std::strcmp(suffix, "log") == 0)
+                    firsts.push_back(first);
+            }
+            closedir(d);
+        }
+        std::sort(firsts.begin(), firsts.end());
+
+        for (int first : firsts)
+        {
+            std::unique_ptr<LogSegment> segment = map_segment(first, 0);
+            if (!segment)
+                continue;
+            scan(*segment);
+            if (segment->offsets.empty() || (!segments.empty() && first <= last))
+                continue; // empty or overlapping what we have
+            last = first + static_cast<int>(segment->offsets.size()) - 1;
+            segments.push_back(std::move(segment));
+        }
+    }
+
+    // Writer thread only. Records within a segment are consecutive, so
+    // after a gap (a segment that could not be created, say) logging goes
+    // on in a new segment starting at seq.
+    bool append(int seq, std::string_view bytes)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (seq <= last)
+            return false; // logged already
+        size_t need = 2 * sizeof(uint32_t) + bytes.size();
+
+        if (segments.empty() || seq != last + 1 ||
+            segments.back()->used + need + sizeof(uint32_t) > segments.back()->capacity)
+        {
+            std::unique_ptr<LogSegment> segment = map_segment(seq, std::max(server_config.log_segment_bytes, need * 2));
+            if (!segment)
+            {
+                if (!failing)
+                    log_warn("[SYSTEM] cannot create a log segment in ", dir, " at seq ", seq, ": ",
+                             std::strerror(errno), ", retrying with the next message.");
+                failing = true;
+                return false;
+            }
+            if (failing)
+                log_warn("[SYSTEM] ", dir, " logging again from seq ", seq, ".");
+            failing = false;
+            segments.push_back(std::move(segment));
+        }
+
+        LogSegment &segment = *segments.back();
+        char *at = segment.base + segment.used;
+        uint32_t len = static_cast<uint32_t>(bytes.size());
+        uint32_t seq32 = static_cast<uint32_t>(seq);
+        std::memcpy(at + sizeof(uint32_t), &seq32, sizeof(seq32));
+        std::memcpy(at + 2 * sizeof(uint32_t), bytes.data(), bytes.size());
+        std::memcpy(at, &len, sizeof(len)); // length last: a record is visible once complete
+        segment.offsets.push_back(static_cast<uint32_t>(segment.used));
+        segment.used += need;
+        last = seq;
+        return true;
+    }
+
+    // Writer thread only: flush appended bytes to disk.
+    void sync()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        for (auto &segment : segments)
+        {
+            if (segment->synced == segment->used)
+                continue;
+            size_t from = segment->synced & ~(page - 1);
+            msync(segment->base + from, segment->used - from, MS_SYNC);
+            segment->synced = segment->used;
+        }
+    }
+
+    int last_seq()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return last;
+    }
+
+    int first_seq()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return segments.empty() ? last + 1 : segments.front()->first_seq;
+    }
+
+    // Copy records from..to (inclusive, clamped to what is logged) into out,
+    // at most max_records. Returns the next seq to read.
+    int read(int from, int to, size_t max_records, std::vector<std::string> &out)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        to = std::min(to, last);
+        if (!segments.empty())
+            from = std::max(from, segments.front()->first_seq);
+
+        auto it = std::upper_bound(segments.begin(), segments.end(), from,
+                                   [](int seq, const std::unique_ptr<LogSegment> &segment)
+                                   { return seq < segment->first_seq; });
+        if (it == segments.begin())
+            return to + 1;
+        --it;
+
+        while (from <= to && out.size() < max_records && it != segments.end())
+        {
+            LogSegment &segment = **it;
+            from = std::max(from, segment.first_seq); // skip a gap between segments
+            if (from > to)
+                break;
+            size_t index = from - segment.first_seq;
+            if (index >= segment.offsets.size())
+            {
+                ++it;
+                continue;
+            }
+            const char *at = segment.base + segment.offsets[index];
+            uint32_t len;
+            std::memcpy(&len, at, sizeof(len));
+            out.emplace_back(at + 2 * sizeof(uint32_t), len);
+            from++;
+        }
+        return from;
+    }
+
+private:
+    std::unique_ptr<LogSegment> map_segment(int first, size_t create_bytes)
+    {
+        char file[32];
+        std::snprintf(file, sizeof(file), "/%010d.log", first);
+        std::string path = dir + file;
+
+        std::unique_ptr<LogSegment> segment(new LogSegment());
+        segment->first_seq = first;
+        int flags = O_RDWR | (create_bytes ? O_CREAT | O_EXCL : 0);
+        segment->fd = open(path.c_str(), flags, 0644);
+        if (segment->fd == -1 && create_bytes && errno == EEXIST)
+        {
+            // a segment load() skipped as not contiguous: keep it, out of the way
+            std::string aside = path + ".skipped-" + std::to_string(std::time(nullptr));
+            log_warn("[SYSTEM] ", path, " already exists, moving it to ", aside);
+            if (std::rename(path.c_str(), aside.c_str()) == 0)
+                segment->fd = open(path.c_str(), flags, 0644);
+        }
+        if (segment->fd == -1)
+            return nullptr;
+
+        struct stat st;
+        if (create_bytes && ftruncate(segment->fd, create_bytes) != 0)
+            return nullptr;
+        if (fstat(segment->fd, &st) != 0 || st.st_size == 0)
+            return nullptr;
+
+        segment->capacity = st.st_size;
+        void *p = mmap(nullptr, segment->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+        segment->base = static_cast<char *>(p);
+        return segment;
+    }
+
+    // Index the records of a segment we did not write in this run.
+    void scan(LogSegment &segment)
+    {
+        size_t pos = 0;
+        int expect = segment.first_seq;
+        while (pos + 2 * sizeof(uint32_t) <= segment.capacity)
+        {
+            uint32_t len, seq;
+            std::memcpy(&len, segment.base + pos, sizeof(len));
+            std::memcpy(&seq, segment.base + pos + sizeof(len), sizeof(seq));
+            if (len == 0 || static_cast<int>(seq) != expect || pos + 2 * sizeof(uint32_t) + len > segment.capacity)
+                break;
+            segment.offsets.push_back(static_cast<uint32_t>(pos));
+            pos += 2 * sizeof(uint32_t) + len;
+            expect++;
+        }
+        segment.used = segment.synced = pos;
+    }
+
+    std::string dir;
+    std::mutex mtx;
+    std::vector<std::unique_ptr<LogSegment>> segments;
+    int last = 0;         // highest seq logged, 0 if none
+    bool failing = false; // the last segment we tried to create failed
+};
+
+class MessageLog
+{
+public:
+    bool enabled() const { return !root.empty(); }
+
+    bool start(const std::string &directory)
+    {
+        if (directory.empty())
+            return true;
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+            return false;
+        root = directory;
+        queue.reset(new TaskQueue<LogRecord>(65536, OverflowPolicy::Block));
+        std::thread(&MessageLog::writer, this).detach();
+        return true;
+    }
+
+    // Opened (and its segments indexed) on first use. nullptr when disabled,
+    // or when the room has no log yet and create is false.
+    RoomLog *room(const std::string &name, bool create = true)
+    {
+        if (!enabled())
+            return nullptr;
+        std::lock_guard<std::mutex> lock(rooms_mtx);
+        auto it = rooms.find(name);
+        if (it != rooms.end())
+            return it->second.get();
+
+        std::string dir = root + "/" + dir_name(name);
+        struct stat st;
+        if (!create && stat(dir.c_str(), &st) != 0)
+            return nullptr;
+        mkdir(dir.c_str(), 0755);
+        std::unique_ptr<RoomLog> &log = rooms[name];
+        log.reset(new RoomLog(dir));
+        log->load();
+        return log.get();
+    }
+
+    // Where a room's sequence continues after a restart.
+    int last_seq(const std::string &name)
+    {
+        RoomLog *log = room(name);
+        return log ? log->last_seq() : 0;
+    }
+
+    // Broadcaster side. Blocks only if the writer is 64k records behind.
+    void append(const std::string &name, int seq, const Payload &payload)
+    {
+        queue->push(LogRecord{name, seq, payload});
+    }
+
+    size_t backlog() const { return queue ? queue->size() : 0; }
+
+private:
+    // Room names go into paths; anything but [A-Za-z0-9_-] is hex-encoded.
+    static std::string dir_name(const std::string &name)
+    {
+        std::string out;
+        for (unsigned char c : name)
+        {
+            if (std::isalnum(c) || c == '_' || c == '-')
+                out += static_cast<char>(c);
+            else
+            {
+                char hex[4];
+                std::snprintf(hex, sizeof(hex), "%%%02X", c);
+                out += hex;
+            }
+        }
+        return out.empty() ? "%" : out;
+    }
+
+    void writer(); // defined after SEARCH INDEX, which it feeds
+
+    std::string root;
+    std::mutex rooms_mtx;
+    std::unordered_map<std::string, std::unique_ptr<RoomLog>> rooms;
+    std::unique_ptr<TaskQueue<LogRecord>> queue;
+};
+
+MessageLog message_log;
+
+// Highest seq of each room that has already been fanned out. Entries are
+// added under registry_lock (write); broadcasters update them while holding
+// it for reading, so join_room sees exactly which messages the new member
+// will not get live.
+std::unordered_map<std::string, std::atomic<int>> room_fanned;
+
+// ============================================================
+//  TRAFFIC CAPTURE
+// ============================================================
+//
+// With --capture FILE the ingest receivers copy every message they take off
+// their queue, stamped with its arrival time, onto a queue drained by one
+// writer thread into FILE (format in protocol.h). The receive loop only pays
+// for the copy: the queue drops rather than blocks if the disk falls behind,
+// and the writer works out who sent each message. ./test replay plays the
+// file back.
+
+struct CapturedMessage
+{
+    std::chrono::steady_clock::time_point received;
+    std::string bytes;
+};
+
+class TrafficCapture
+{
+public:
+    bool enabled() const { return out != nullptr; }
+
+    bool start(const std::string &path)
+    {
+        if (path.empty())
+            return true;
+        out = std::fopen(path.c_str(), "wb");
+        if (!out)
+            return false;
+        std::setvbuf(out, nullptr, _IOFBF, 1 << 20);
+
+        CaptureHeader header{};
+        std::memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.mq_msgsize = static_cast<uint32_t>(server_config.mq_msgsize);
+        header.started_unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::system_clock::now().time_since_epoch())
+                                     .count();
+        started = std::chrono::steady_clock::now();
+        std::fwrite(&header, sizeof(header), 1, out);
+        std::fflush(out);
+
+        queue.reset(new TaskQueue<CapturedMessage>(65536, OverflowPolicy::Drop));
+        std::thread(&TrafficCapture::writer, this).detach();
+        return true;
+    }
+
+    // Ingest side; never blocks.
+    void record(const char *buf, size_t n)
+    {
+        queue->push(CapturedMessage{std::chrono::steady_clock::now(), std::string(buf, n)});
+    }
+
+    uint64_t written() const { return written_count.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return queue ? queue->dropped() : 0; }
+    size_t backlog() const { return queue ? queue->size() : 0; }
+
+private:
+    void writer(); // defined after the protocol parsers, which it uses to name senders
+
+    std::FILE *out = nullptr;
+    std::chrono::steady_clock::time_point started;
+    std::unique_ptr<TaskQueue<CapturedMessage>> queue;
+    std::atomic<uint64_t> written_count{0};
+};
+
+TrafficCapture traffic_capture;
+
+// ============================================================
+//  EGRESS REACTOR
+// ============================================================
+//
+// A Spill client whose queue is full gets its messages parked in its
+// pending-output queue, and its mqd (a pollable fd on Linux) is watched
+// with epoll for EPOLLOUT. The reactor thread flushes the queue as the
+// client drains it, so broadcasters never wait on a slow consumer.
+// A shared-memory ring has no fd to poll, so while a ring client is parked
+// the reactor wakes every millisecond and retries it instead.
+
+// One message to a client over its transport: a ring record for CAP_SHM
+// clients, an mq message at the given priority otherwise. Fails with errno
+// EAGAIN when full; every failure is counted by errno, with errno left
+// intact for the caller.
+int client_send(ClientHandle &client, const char *data, size_t size, unsigned priority)
+{
+    int sent;
+    if (!client.ring)
+        sent = mq_send(client.mqd, data, size, priority);
+    else
+    {
+        std::lock_guard<std::mutex> lock(client.ring_mtx);
+        sent = client.ring->try_write(data, size) ? 0 : -1;
+    }
+    if (sent == -1)
+        count_send_error(errno);
+    return sent;
+}
+
+// Send pending messages, oldest first, until the queue fills again.
+// Caller holds client.send_mtx.
+void flush_pending_locked(ClientHandle &client)
+{
+    auto now = std::chrono::steady_clock::now();
+    while (!client.pending.empty())
+    {
+        const PendingMessage &msg = client.pending.front();
+        if (client_send(client, msg.bytes.data(), msg.bytes.size(), msg.priority) == -1)
+            return;
+        record_metric(M_FLUSH_LATENCY, now - msg.queued);
+        client.pending_bytes.fetch_sub(msg.bytes.size(), std::memory_order_relaxed);
+        client.pending.pop_front();
+        client.redelivered.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+class EgressReactor
+{
+public:
+    bool start()
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd == -1)
+            return false;
+        std::thread(&EgressReactor::run, this).detach();
+        return true;
+    }
+
+    // Start watching a client that has just parked its first message.
+    // Caller holds client.send_mtx.
+    void park(ClientHandle &client)
+    {
+        std::lock_guard<std::mutex> lock(watched_mtx);
+        if (!watched.emplace(client.mqd, client.shared_from_this()).second)
+            return;
+        client.parked = true;
+        if (client.ring)
+        {
+            parked_rings++;
+            return;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLOUT;
+        ev.data.fd = client.mqd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, client.mqd, &ev);
+    }
+
+    size_t parked_clients()
+    {
+        std::lock_guard<std::mutex> lock(watched_mtx);
+        return watched.size();
+    }
+
+private:
+    // Caller holds client.send_mtx.
+    void unpark(ClientHandle &client)
+    {
+        std::lock_guard<std::mutex> lock(watched_mtx);
+        if (client.ring)
+            parked_rings--;
+        else
+            epoll_ctl(epfd, EPOLL_CTL_DEL, client.mqd, nullptr);
+        watched.erase(client.mqd);
+        client.parked = false;
+    }
+
+    void flush(ClientHandle &client)
+    {
+        std::lock_guard<std::mutex> lock(client.send_mtx);
+        if (client.retired)
+            discard_pending_locked(client); // its queue may already belong to a new session
+        else
+            flush_pending_locked(client);
+        if (client.pending.empty() && client.parked)
+            unpark(client);
+    }
+
+    std::vector<std::shared_ptr<ClientHandle>> parked_ring_clients()
+    {
+        std::lock_guard<std::mutex> lock(watched_mtx);
+        std::vector<std::shared_ptr<ClientHandle>> rings;
+        for (auto &entry : watched)
+            if (entry.second->ring)
+                rings.push_back(entry.second);
+        return rings;
+    }
+
+    std::shared_ptr<ClientHandle> lookup(int fd)
+    {
+        std::lock_guard<std::mutex> lock(watched_mtx);
+        auto it = watched.find(fd);
+        return it == watched.end() ? nullptr : it->second;
+    }
+
+    void run()
+    {
+        struct epoll_event events[64];
+        auto next_sweep = std::chrono::steady_clock::now() + RETIRED_SWEEP;
+        while (true)
+        {
+            int n = epoll_wait(epfd, events, 64, parked_rings > 0 ? 1 : 1000);
+            for (int i = 0; i < n; ++i)
+            {
+                if (std::shared_ptr<ClientHandle> client = lookup(events[i].data.fd))
+                    flush(*client);
+            }
+            if (parked_rings > 0)
+            {
+                for (const std::shared_ptr<ClientHandle> &client : parked_ring_clients())
+                    flush(*client);
+            }
+            // on a timer as well as when idle: steady EPOLLOUT traffic or a
+            // parked ring keeps epoll_wait from ever returning 0
+            auto now = std::chrono::steady_clock::now();
+            if (n == 0 || now >= next_sweep)
+            {
+                release_retired();
+                next_sweep = now + RETIRED_SWEEP;
+            }
+        }
+    }
+
+    // A client that quit may never drain its queue again; let its handle
+    // (and its descriptor) go instead of holding it here forever.
+    void release_retired()
+    {
+        for (const std::shared_ptr<ClientHandle> &client : retired_clients())
+        {
+            std::lock_guard<std::mutex> lock(client->send_mtx);
+            discard_pending_locked(*client);
+            if (client->parked)
+                unpark(*client);
+        }
+    }
+
+    // Caller holds client.send_mtx.
+    static void discard_pending_locked(ClientHandle &client)
+    {
+        client.pending_bytes = 0;
+        client.pending.clear();
+    }
+
+    std::vector<std::shared_ptr<ClientHandle>> retired_clients()
+    {
+        std::lock_guard<std::mutex> lock(watched_mtx);
+        std::vector<std::shared_ptr<ClientHandle>> retired;
+        for (auto &entry : watched)
+            if (entry.second->retired)
+                retired.push_back(entry.second);
+        return retired;
+    }
+
+    static constexpr std::chrono::milliseconds RETIRED_SWEEP{1000};
+
+    int epfd = -1;
+    std::atomic<int> parked_rings{0};
+    std::mutex watched_mtx; // taken after a client's send_mtx, never before
+    std::unordered_map<int, std::shared_ptr<ClientHandle>> watched; // mqd -> parked client
+};
+
+EgressReactor egress_reactor;
+
+// ============================================================
+//  SEARCH INDEX
+// ============================================================
+//
+// Logged messages are indexed by an indexer thread fed from the log writer,
+// never by broadcasters. Each room maps a term to a posting list of the
+// seqs that contain it. A list is a run of blocks of up to 128 seqs: the
+// first seq in full, then varint deltas. Block bounds let a query walk a
+// list newest first and test membership without decoding the whole list.
+// A room's history from before the server started is indexed from its log
+// the first time the room is touched.
+
+class PostingList
+{
+public:
+    static const uint16_t BLOCK = 128;
+
+    // seqs arrive in increasing order
+    void add(uint32_t seq)
+    {
+        if (!blocks.empty() && seq <= blocks.back().last)
+            return;
+        if (blocks.empty() || blocks.back().count == BLOCK)
+            blocks.push_back(Block{seq, seq, 1, std::string()});
+        else
+        {
+            Block &block = blocks.back();
+            for (uint32_t delta = seq - block.last; ; delta >>= 7)
+            {
+                if (delta < 0x80)
+                {
+                    block.deltas.push_back(static_cast<char>(delta));
+                    break;
+                }
+                block.deltas.push_back(static_cast<char>((delta & 0x7F) | 0x80));
+            }
+            block.last = seq;
+            block.count++;
+        }
+        total++;
+    }
+
+    size_t size() const { return total; }
+    size_t block_count() const { return blocks.size(); }
+
+    void decode(size_t index, std::vector<uint32_t> &out) const
+    {
+        const Block &block = blocks[index];
+        out.clear();
+        out.push_back(block.first);
+        uint32_t seq = block.first;
+        for (size_t pos = 0; pos < block.deltas.size();)
+        {
+            uint32_t delta = 0;
+            for (int shift = 0; pos < block.deltas.size(); shift += 7)
+            {
+                uint8_t byte = static_cast<uint8_t>(block.deltas[pos++]);
+                delta |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                    break;
+            }
+            seq += delta;
+            out.push_back(seq);
+        }
+    }
+
+    // Index of the block whose range holds seq, or -1.
+    long find_block(uint32_t seq) const
+    {
+        auto it = std::upper_bound(blocks.begin(), blocks.end(), seq,
+                                   [](uint32_t value, const Block &block)
+                                   { return value < block.first; });
+        if (it == blocks.begin() || seq > (it - 1)->last)
+            return -1;
+        return static_cast<long>(it - blocks.begin()) - 1;
+    }
+
+private:
+    struct Block
+    {
+        uint32_t first;
+        uint32_t last;
+        uint16_t count;
+        std::string deltas;
+    };
+
+    std::vector<Block> blocks;
+    size_t total = 0;
+};
+
+// Membership tests for seqs visited in descending order; keeps the last
+// decoded block.
+class PostingCursor
+{
+public:
+    explicit PostingCursor(const PostingList &posting) : list(&posting) {}
+
+    bool contains(uint32_t seq)
+    {
+        long index = list->find_block(seq);
+        if (index < 0)
+            return false;
+        if (index != block)
+        {
+            list->decode(index, decoded);
+            block = index;
+        }
+        return std::binary_search(decoded.begin(), decoded.end(), seq);
+    }
+
+private:
+    const PostingList *list;
+    long block = -1;
+    std::vector<uint32_t> decoded;
+};
+
+// Lower-cased runs of letters and digits, 2..32 bytes. Bytes >= 0x80 count
+// as letters so UTF-8 words stay whole. A leading "[SEQ:n] " tag is skipped.
+template <typename Fn>
+void for_each_term(std::string_view text, Fn fn)
+{
+    if (text.compare(0, 5, "[SEQ:") == 0)
+    {
+        size_t end = text.find("] ");
+        if (end != std::string_view::npos)
+            text.remove_prefix(end + 2);
+    }
+
+    std::string term;
+    for (size_t i = 0; i <= text.size(); ++i)
+    {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : 0;
+        if (std::isalnum(c) || c >= 0x80)
+        {
+            term += static_cast<char>(std::tolower(c));
+            continue;
+        }
+        if (term.size() >= 2 && term.size() <= 32)
+            fn(term);
+        term.clear();
+    }
+}
+
+struct RoomIndex
+{
+    RoomIndex() { pthread_rwlock_init(&lock, NULL); }
+    ~RoomIndex() { pthread_rwlock_destroy(&lock); }
+
+    pthread_rwlock_t lock;
+    bool loaded = false;  // history from the log has been indexed
+    int indexed_upto = 0; // highest seq indexed
+    std::unordered_map<std::string, PostingList> terms;
+};
+
+class SearchIndex
+{
+public:
+    void start()
+    {
+        queue.reset(new TaskQueue<LogRecord>(65536, OverflowPolicy::Block));
+        std::thread(&SearchIndex::indexer, this).detach();
+    }
+
+    // Log writer side.
+    void add(LogRecord &&record)
+    {
+        if (queue)
+            queue->push(std::move(record));
+    }
+
+    // The newest `limit` seqs in room that contain every term.
+    std::vector<uint32_t> search(const std::string &room_name, const std::vector<std::string> &query, size_t limit)
+    {
+        std::vector<uint32_t> hits;
+        RoomIndex *index = room(room_name);
+        if (!index || query.empty())
+            return hits;
+
+        ReadLock lock(index->lock);
+        std::vector<const PostingList *> lists;
+        for (const std::string &term : query)
+        {
+            auto it = index->terms.find(term);
+            if (it == index->terms.end())
+                return hits;
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](const PostingList *a, const PostingList *b)
+                  { return a->size() < b->size(); });
+
+        // walk the rarest term newest first, probe the others
+        std::vector<PostingCursor> others;
+        for (size_t i = 1; i < lists.size(); ++i)
+            others.emplace_back(*lists[i]);
+
+        std::vector<uint32_t> block;
+        for (long b = static_cast<long>(lists[0]->block_count()) - 1; b >= 0 && hits.size() < limit; --b)
+        {
+            lists[0]->decode(b, block);
+            for (auto seq = block.rbegin(); seq != block.rend() && hits.size() < limit; ++seq)
+            {
+                bool all = true;
+                for (PostingCursor &cursor : others)
+                    all = all && cursor.contains(*seq);
+                if (all)
+                    hits.push_back(*seq);
+            }
+        }
+        return hits;
+    }
+
+    size_t backlog() const { return queue ? queue->size() : 0; }
+
+private:
+    RoomIndex *room(const std::string &name)
+    {
+        RoomLog *log = message_log.room(name, false);
+        if (!log)
+            return nullptr;
+
+        RoomIndex *index;
+        {
+            std::lock_guard<std::mutex> lock(rooms_mtx);
+            std::unique_ptr<RoomIndex> &entry = rooms[name];
+            if (!entry)
+                entry.reset(new RoomIndex());
+            index = entry.get();
+        }
+
+        {
+            ReadLock r(index->lock);
+            if (index->loaded)
+                return index;
+        }
+
+        WriteLock w(index->lock);
+        if (!index->loaded)
+        {
+            // everything logged so far; newer records still come through the queue
+            std::vector<std::string> records;
+            int next = log->first_seq();
+            int last = log->last_seq();
+            while (next <= last)
+            {
+                records.clear();
+                int from = next;
+                next = log->read(next, last, 4096, records);
+                for (const std::string &text : records)
+                    index_locked(*index, from++, text);
+            }
+            index->loaded = true;
+        }
+        return index;
+    }
+
+    static void index_locked(RoomIndex &index, int seq, std::string_view text)
+    {
+        if (seq <= index.indexed_upto)
+            return;
+        for_each_term(text, [&](const std::string &term)
+                      { index.terms[term].add(seq); });
+        index.indexed_upto = seq;
+    }
+
+    void indexer()
+    {
+        std::vector<LogRecord> batch;
+        while (true)
+        {
+            batch.clear();
+            queue->pop_batch(batch, 256);
+
+            for (size_t i = 0; i < batch.size();)
+            {
+                // one write lock per run of records for the same room
+                RoomIndex *index = room(batch[i].room);
+                WriteLock lock(index->lock);
+                size_t j = i;
+                for (; j < batch.size() && batch[j].room == batch[i].room; ++j)
+                    index_locked(*index, batch[j].seq, batch[j].payload.view());
+                i = j;
+            }
+        }
+    }
+
+    std::mutex rooms_mtx;
+    std::unordered_map<std::string, std::unique_ptr<RoomIndex>> rooms;
+    std::unique_ptr<TaskQueue<LogRecord>> queue;
+};
+
+SearchIndex search_index;
+
+void MessageLog::writer()
+{
+    std::vector<LogRecord> batch;
+    std::unordered_set<RoomLog *> dirty;
+    const auto interval = std::chrono::milliseconds(server_config.log_fsync_ms);
+    auto next_sync = std::chrono::steady_clock::now() + interval;
+
+    while (true)
+    {
+        batch.clear();
+        if (dirty.empty())
+            queue->pop_batch(batch, 256);
+        else
+            queue->pop_batch_until(batch, 256, next_sync);
+
+        for (LogRecord &record : batch)
+        {
+            RoomLog *log = room(record.room);
+            if (!log->append(record.seq, record.payload.view()))
+                continue;
+            dirty.insert(log);
+            search_index.add(std::move(record)); // only logged messages are searchable
+        }
+
+        if (!dirty.empty() && std::chrono::steady_clock::now() >= next_sync)
+        {
+            for (RoomLog *log : dirty)
+                log->sync();
+            dirty.clear();
+            next_sync = std::chrono::steady_clock::now() + interval;
+        }
+        else if (dirty.empty())
+            next_sync = std::chrono::steady_clock::now() + interval;
+    }
+}
+
+// ============================================================
+//  CLIENT DELIVERY
+// ============================================================
+
+// Make room in a full client queue by receiving (discarding) its oldest
+// message. Caller holds client.send_mtx.
+bool drop_oldest_locked(ClientHandle &client)
+{
+    if (client.drain_mqd == -1)
+    {
+        std::string qname = "/client_" + client.name;
+        client.drain_mqd = mq_open(qname.c_str(), O_RDONLY | O_NONBLOCK);
+        if (client.drain_mqd == -1)
+            return false;
+    }
+
+    thread_local std::vector<char> scratch;
+    scratch.resize(server_config.mq_msgsize);
+    if (mq_receive(client.drain_mqd, scratch.data(), scratch.size(), nullptr) == -1)
+        return false;
+    client.dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Send one mq message of exactly size bytes to a client, applying its
+// overflow policy if the queue is full.
+bool deliver(ClientHandle &client, const char *data, size_t size, unsigned priority = PRIO_CHAT)
+{
+    if (client.overflow == ClientOverflow::DropNewest)
+    {
+        if (client_send(client, data, size, priority) == 0)
+            return true;
+        if (errno == EAGAIN)
+            client.dropped_newest.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(client.send_mtx);
+
+    // A ring has no read side for the server to pull from, so for CAP_SHM
+    // clients DropOldest drops the newest message instead: emptying their
+    // message queue would lose a notice and free no ring space.
+    if (client.overflow == ClientOverflow::DropOldest)
+    {
+        if (client_send(client, data, size, priority) == 0)
+            return true;
+        if (errno == EAGAIN && !client.ring && drop_oldest_locked(client) &&
+            client_send(client, data, size, priority) == 0)
+            return true;
+        client.dropped_newest.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Spill: while the client is parked, newer messages queue behind the
+    // pending ones and the reactor sends them in order, except that control
+    // messages go ahead of any pending chat.
+    if (!client.parked)
+    {
+        if (client_send(client, data, size, priority) == 0)
+            return true;
+        if (errno != EAGAIN)
+            return false;
+    }
+
+    if (client.pending.size() >= server_config.spill_limit || client.retired)
+    {
+        client.dropped_newest.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    PendingMessage message{std::string(data, size), std::chrono::steady_clock::now(), priority};
+    if (priority == PRIO_CHAT)
+        client.pending.push_back(std::move(message));
+    else
+        client.pending.insert(std::find_if(client.pending.begin(), client.pending.end(), [&](const PendingMessage &queued)
+                                           { return queued.priority < priority; }),
+                              std::move(message));
+    client.pending_bytes.fetch_add(size, std::memory_order_relaxed);
+    client.spilled.fetch_add(1, std::memory_order_relaxed);
+    if (!client.parked)
+        egress_reactor.park(client);
+    return true;
+}
+
+// data must be NUL-terminated at data[len]; clients read messages as C strings.
+bool send_to_client(const std::string &client_name, const char *data, size_t len)
+{
+    std::shared_ptr<ClientHandle> handle = client_handles.get(client_name);
+    if (!handle)
+        return false;
+    return deliver(*handle, data, len + 1);
+}
+
+bool send_to_client(const std::string &client_name, const std::string &payload)
+{
+    return send_to_client(client_name, payload.c_str(), payload.size());
+}
+
+// Send a multi-line reply as few mq messages as fit in mq_msgsize, lines
+// joined by '\n'. A line longer than a message is cut short.
+void deliver_lines(ClientHandle &client, const std::vector<std::string> &lines)
+{
+    const size_t chunk_limit = server_config.mq_msgsize - 1;
+    std::string chunk;
+    for (const std::string &line : lines)
+    {
+        if (!chunk.empty() && chunk.size() + 1 + line.size() > chunk_limit)
+        {
+            deliver(client, chunk.c_str(), chunk.size() + 1);
+            chunk.clear();
+        }
+        if (!chunk.empty())
+            chunk += '\n';
+        chunk.append(line, 0, chunk_limit);
+    }
+    if (!chunk.empty())
+        deliver(client, chunk.c_str(), chunk.size() + 1);
+}
+
+int room_shard(const std::string &room)
+{
+    return name_id(room) % NUM_BROADCAST_SHARDS;
+}
+
+int64_t steady_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Hand a shard that was just given work to the pool, unless it is already
+// waiting or being run. The fence pairs with the one in release_shard: one
+// of the two sides always sees the other's write.
+void schedule_shard(int index)
+{
+    BroadcastShard &shard = *broadcast_shards[index];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (shard.scheduled.exchange(true))
+        return;
+    shard.ready_since_ns.store(steady_ns(), std::memory_order_relaxed);
+    ready_shards.push(int(index));
+}
+
+PushResult enqueue_broadcast(BroadcastTask &&task)
+{
+    int index = room_shard(task.target_room);
+    BroadcastShard &shard = *broadcast_shards[index];
+    task.queued = std::chrono::steady_clock::now();
+    PushResult result;
+    if (task.priority == PRIO_CHAT)
+        result = shard.chat.push(std::move(task));
+    else
+    {
+        result = shard.control.push(std::move(task));
+        shard.chat.interrupt(); // a worker lingering on the shard sleeps on the chat lane
+    }
+    if (result == PushResult::Ok)
+        schedule_shard(index);
+    return result;
+}
+
+// ============================================================
+//  BACKLOG REPLAY
+// ============================================================
+//
+// A JOIN may ask for history with ";last=N" or ";since=S". join_room works
+// out the last seq the new member will not get live and queues the range
+// here. The replay thread streams it from the room log a chunk at a time,
+// and only while the client has room for it, so a long backlog never fills
+// the client's pending queue or competes with live fan-out.
+
+struct BacklogRequest
+{
+    int last = 0;  // the N most recent messages
+    int since = 0; // every message after seq S
+
+    bool wanted() const { return last > 0 || since > 0; }
+};
+
+struct ReplayJob
+{
+    std::shared_ptr<ClientHandle> client;
+    std::string room;
+    int next;
+    int last;
+    bool started;
+    std::chrono::steady_clock::time_point give_up; // stop waiting for the log writer
+};
+
+class BacklogReplayer
+{
+public:
+    void start() { std::thread(&BacklogReplayer::run, this).detach(); }
+
+    void submit(const std::shared_ptr<ClientHandle> &client, const std::string &room, int from, int to)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            incoming.push_back(ReplayJob{client, room, from, to, false,
+                                         std::chrono::steady_clock::now() + std::chrono::seconds(5)});
+        }
+        cv.notify_one();
+    }
+
+private:
+    static const size_t CHUNK = 64;
+
+    // How many records the client can take right now.
+    static size_t room_for(ClientHandle &client)
+    {
+        if (client.pending_bytes.load(std::memory_order_relaxed) > 0)
+            return 0;
+        struct mq_attr attr;
+        if (client.ring || mq_getattr(client.mqd, &attr) != 0)
+            return CHUNK;
+        long free_slots = attr.mq_maxmsg - attr.mq_curmsgs;
+        if (free_slots <= 0)
+            return 0;
+        return (client.caps & CAP_BATCH) ? CHUNK : std::min<size_t>(free_slots, CHUNK);
+    }
+
+    static void send_records(ClientHandle &client, const std::vector<std::string> &records)
+    {
+        if (!(client.caps & CAP_BATCH))
+        {
+            for (const std::string &record : records)
+                deliver(client, record.c_str(), record.size() + 1);
+            return;
+        }
+
+        BatchWriter writer(server_config.batch_bytes);
+        for (const std::string &record : records)
+        {
+            if (!writer.fits_alone(record.size()))
+            {
+                deliver(client, record.c_str(), record.size() + 1);
+                continue;
+            }
+            if (!writer.add(record))
+            {
+                deliver(client, writer.bytes().data(), writer.bytes().size());
+                writer.clear();
+                writer.add(record);
+            }
+        }
+        if (!writer.empty())
+            deliver(client, writer.bytes().data(), writer.bytes().size());
+    }
+
+    static void notice(ClientHandle &client, const std::string &text)
+    {
+        deliver(client, text.c_str(), text.size() + 1);
+    }
+
+    // Returns true if the job is finished.
+    static bool step(ReplayJob &job, std::vector<std::string> &records, bool &progress)
+    {
+        if (job.client->retired)
+            return true;
+        RoomLog *log = message_log.room(job.room);
+
+        if (!job.started)
+        {
+            job.next = std::max(job.next, log->first_seq());
+            notice(*job.client, "[HISTORY]: " + std::to_string(std::max(0, job.last - job.next + 1)) +
+                                    " earlier messages in #" + job.room);
+            job.started = true;
+        }
+
+        int logged = log->last_seq();
+        if (logged < job.last && std::chrono::steady_clock::now() > job.give_up)
+            job.last = logged;
+
+        size_t budget = room_for(*job.client);
+        if (job.next <= job.last && budget > 0 && logged >= job.next)
+        {
+            records.clear();
+            job.next = log->read(job.next, job.last, budget, records);
+            if (job.client->caps & CAP_ROOMS)
+                for (std::string &record : records)
+                    record.insert(0, "[#" + job.room + "] ");
+            send_records(*job.client, records);
+            progress = true;
+        }
+
+        if (job.next <= job.last)
+            return false;
+        notice(*job.client, "[HISTORY]: end of #" + job.room);
+        return true;
+    }
+
+    void run()
+    {
+        std::vector<ReplayJob> active;
+        std::vector<std::string> records;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                if (active.empty())
+                    cv.wait(lock, [this]
+                            { return !incoming.empty(); });
+                for (ReplayJob &job : incoming)
+                    active.push_back(std::move(job));
+                incoming.clear();
+            }
+
+            bool progress = false;
+            for (size_t i = 0; i < active.size();)
+            {
+                if (step(active[i], records, progress))
+                {
+                    active[i] = std::move(active.back());
+                    active.pop_back();
+                }
+                else
+                    ++i;
+            }
+            if (!progress && !active.empty())
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<ReplayJob> incoming;
+};
+
+BacklogReplayer backlog_replayer;
+
+// ============================================================
+//  ROOM ROSTERS
+// ============================================================
+//
+// The WHO reply for a room is rendered once and cached until its membership
+// next changes, so polling WHO costs a map lookup and the sends. Every
+// membership change bumps the room's version and drops the cached reply; a
+// reply built from an older version is used for that request but not kept.
+// Members are listed in name order, as many per mq message as fit. A reply
+// that needs several messages numbers them, "[Members in #room 1/3]: ...",
+// and every message but the last ends with " ...".
+
+struct Roster
+{
+    uint64_t version = 0;
+    size_t members = 0;
+    std::vector<std::string> messages; // ready to send, without the NUL
+};
+
+class RosterCache
+{
+public:
+    // The current reply for room. Called without registry_lock.
+    std::shared_ptr<const Roster> get(const std::string &room)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = rooms.find(room);
+            if (it != rooms.end() && it->second.cached)
+            {
+                hit_count++;
+                return it->second.cached;
+            }
+        }
+
+        std::vector<std::string> names;
+        auto roster = std::make_shared<Roster>();
+        bool exists;
+        {
+            ReadLock lock(registry_lock);
+            auto members = room_members.find(room);
+            exists = members != room_members.end();
+            if (exists)
+                members->second.for_each([&](uint32_t slot)
+                                         { names.push_back(client_directory.at(slot).name); });
+            std::lock_guard<std::mutex> cache_lock(mtx);
+            auto it = rooms.find(room);
+            roster->version = it == rooms.end() ? 0 : it->second.version;
+        }
+        std::sort(names.begin(), names.end());
+        roster->members = names.size();
+        roster->messages = render(room, names, server_config.mq_msgsize - 1);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        build_count++;
+        if (!exists)
+            return roster; // nothing to invalidate it later, so not kept
+        Entry &entry = rooms[room];
+        if (entry.version == roster->version)
+            entry.cached = roster;
+        return roster;
+    }
+
+    // Membership of room changed. Caller holds registry_lock for writing.
+    void invalidate(const std::string &room)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        Entry &entry = rooms[room];
+        entry.version++;
+        entry.cached.reset();
+    }
+
+    uint64_t hits()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return hit_count;
+    }
+
+    uint64_t builds()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return build_count;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t version = 0;
+        std::shared_ptr<const Roster> cached;
+    };
+
+    static std::vector<std::string> render(const std::string &room, const std::vector<std::string> &names,
+                                           size_t limit)
+    {
+        const std::string more = " ...";
+        std::vector<std::vector<std::string>> pages(1);
+        size_t used = 0;
+        // "[Members in #room 99/99]: " leaves room for the page numbers
+        size_t space = limit - std::min(limit / 2, room.size() + 32 + more.size());
+        for (const std::string &name : names)
+        {
+            size_t cost = (pages.back().empty() ? 0 : 2) + name.size();
+            if (!pages.back().empty() && used + cost > space)
+            {
+                pages.emplace_back();
+                used = 0;
+                cost = name.size();
+            }
+            pages.back().push_back(name);
+            used += cost;
+        }
+
+        std::vector<std::string> messages;
+        for (size_t i = 0; i < pages.size(); ++i)
+        {
+            std::string message = "[Members in #" + room;
+            if (pages.size() > 1)
+                message += " " + std::to_string(i + 1) + "/" + std::to_string(pages.size());
+            message += "]: ";
+            if (pages[i].empty())
+                message += "(empty)";
+            for (size_t j = 0; j < pages[i].size(); ++j)
+                message += (j ? ", " : "") + pages[i][j];
+            if (i + 1 < pages.size())
+                message += more;
+            messages.push_back(message.substr(0, limit));
+        }
+        return messages;
+    }
+
+    std::mutex mtx;
+    std::unordered_map<std::string, Entry> rooms;
+    uint64_t hit_count = 0;
+    uint64_t build_count = 0;
+};
+
+RosterCache room_rosters;
+
+// ============================================================
+//  ROOM MEMBERSHIP (caller holds registry_lock for writing)
+// ============================================================
+
+// Add a client to room and make it the client's current room. logged is
+// the room's last logged seq, used if this is the first JOIN. Returns
+// false if the client was already a member.
+bool add_to_room(const std::string &client_name, const std::string &room, int logged)
+{
+    uint32_t slot = client_directory.acquire(client_name);
+    ClientSlot &client = *client_directory.entry(client_name);
+    client.current = room;
+    if (!room_members[room].set(slot))
+        return false;
+
+    client.rooms.push_back(room);
+    room_rosters.invalidate(room);
+    room_fanned.try_emplace(room, logged);
+    return true;
+}
+
+// Returns false if the client was not in room.
+bool remove_from_room(const std::string &client_name, const std::string &room)
+{
+    int slot = client_directory.find(client_name);
+    auto members = room_members.find(room);
+    if (slot < 0 || members == room_members.end() || !members->second.clear(slot))
+        return false;
+
+    ClientSlot &client = *client_directory.entry(client_name);
+    client.rooms.erase(std::find(client.rooms.begin(), client.rooms.end(), room));
+    if (client.current == room)
+        client.current = client.rooms.empty() ? "" : client.rooms.back();
+    room_rosters.invalidate(room);
+    return true;
+}
+
+// Remove a client from every room it is in. Returns the rooms it left.
+std::vector<std::string> remove_from_all_rooms(const std::string &client_name)
+{
+    ClientSlot *client = client_directory.entry(client_name);
+    if (!client)
+        return {};
+    std::vector<std::string> left = client->rooms;
+    for (const std::string &room : left)
+        remove_from_room(client_name, room);
+    return left;
+}
+
+// ============================================================
+//  FUNCTION DECLARATIONS
+// ============================================================
+
+void quit_client(const std::string &client_name);
+
+// ============================================================
+//  HEARTBEAT SYSTEM
+// ============================================================
+
+int64_t steady_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Hashed timing wheel of client deadlines. Marking a client alive is a
+// relaxed store to its last_seen_ms; the wheel is not touched. When a slot
+// comes due, each entry in it either expires or is moved forward to
+// last_seen + timeout, so a sweep only visits clients whose previous
+// deadline has come around, never the whole client table.
+class HeartbeatWheel
+{
+public:
+    void configure(int64_t tick, int64_t timeout)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tick_ms = tick;
+        timeout_ms = timeout;
+        slots.assign(std::min<int64_t>(timeout / tick + 2, MAX_SLOTS), {});
+        current_tick = steady_ms() / tick_ms;
+    }
+
+    void schedule(const std::shared_ptr<ClientHandle> &client, int64_t deadline_ms)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        int64_t tick = std::max((deadline_ms + tick_ms - 1) / tick_ms, current_tick + 1);
+        slots[tick % slots.size()].push_back(client);
+        tracked++;
+    }
+
+    // Advance the wheel to now_ms and return the clients that timed out.
+    std::vector<std::shared_ptr<ClientHandle>> advance(int64_t now_ms)
+    {
+        std::vector<std::shared_ptr<ClientHandle>> expired;
+        std::vector<std::weak_ptr<ClientHandle>> due;
+
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (current_tick >= now_ms / tick_ms)
+                    break;
+                current_tick++;
+                due.swap(slots[current_tick % slots.size()]);
+                tracked -= due.size();
+            }
+
+            for (const std::weak_ptr<ClientHandle> &entry : due)
+            {
+                std::shared_ptr<ClientHandle> client = entry.lock();
+                if (!client || client->retired)
+                    continue; // quit normally; just forget it
+                int64_t deadline = client->last_seen_ms.load(std::memory_order_relaxed) + timeout_ms;
+                if (deadline <= now_ms)
+                    expired.push_back(client);
+                else
+                    schedule(client, deadline);
+            }
+            due.clear();
+        }
+        return expired;
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return tracked;
+    }
+
+    int64_t timeout() const { return timeout_ms; }
+
+private:
+    static constexpr int64_t MAX_SLOTS = 4096; // longer timeouts just wrap and get re-checked
+
+    std::mutex mtx;
+    std::vector<std::vector<std::weak_ptr<ClientHandle>>> slots;
+    int64_t tick_ms = 1000;
+    int64_t timeout_ms = 30000;
+    int64_t current_tick = 0;
+    size_t tracked = 0;
+};
+
+HeartbeatWheel heartbeat_wheel;
+
+// Called for every inbound message from a client, so busy clients never
+// need to ping.
+void touch_heartbeat(const std::string &client_name)
+{
+    std::shared_ptr<ClientHandle> client = client_handles.find(client_name);
+    if (!client)
+        return;
+
+    int64_t now = steady_ms();
+    client->last_seen_ms.store(now, std::memory_order_relaxed);
+    if (!client->in_wheel.exchange(true))
+        heartbeat_wheel.schedule(client, now + heartbeat_wheel.timeout());
+}
+
+void heartbeat_cleaner()
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(server_config.heartbeat_sweep_ms));
+
+        for (const std::shared_ptr<ClientHandle> &client : heartbeat_wheel.advance(steady_ms()))
+        {
+            if (client_handles.find(client->name) != client)
+                continue; // the name has registered again since
+            log_info("[SYSTEM] Heartbeat timeout for ", client->name, ". Cleaning up.");
+            quit_client(client->name);
+        }
+    }
+}
+
+// ============================================================
+//  SHARED-MEMORY BLOBS
+// ============================================================
+//
+// A SAY or DM whose text is an "@blob <object> <bytes>" handle (see BLOBS
+// in protocol.h) hands the object to the server, which copies it into a
+// read-only "/chat_copy_<pid>_<n>" of its own and sends that handle on
+// instead: the sender can still write or truncate its object, and a
+// recipient mapping a truncated object dies of SIGBUS. The broadcaster registers
+// every recipient as a holder before it sends the handle on, and the object
+// is unlinked once the last holder has sent RELEASE or gone away. A
+// recipient the handle could not be sent to is released again at once, and
+// a blob still held after --blob-ttl seconds is unlinked anyway. Messages
+// that are refused or have nobody to go to free their blob straight away.
+// A handle that does not check out is passed on as ordinary text.
+
+class BlobRegistry
+{
+public:
+    // If object is a blob created by sender, of exactly bytes, copy it to a
+    // read-only object of the server's, unlink the sender's and return the
+    // copy's name. Returns an empty string otherwise.
+    std::string adopt(const std::string &sender, const std::string &object, size_t bytes)
+    {
+        std::string prefix = blob_prefix(sender);
+        std::string copy;
+        if (object.size() > prefix.size() && object.compare(0, prefix.size(), prefix) == 0 &&
+            object.find_first_not_of("0123456789", prefix.size()) == std::string::npos)
+        {
+            int src = shm_open(object.c_str(), O_RDONLY, 0);
+            struct stat st;
+            if (src != -1 && fstat(src, &st) == 0 && static_cast<size_t>(st.st_size) == bytes)
+                copy = copy_object(src, bytes);
+            if (src != -1)
+                close(src);
+        }
+        if (copy.empty())
+        {
+            rejected_count.fetch_add(1, std::memory_order_relaxed);
+            return copy;
+        }
+        shm_unlink(object.c_str());
+        return copy;
+    }
+
+    // Add the recipients of one delivery; with none the blob is freed now.
+    void hold(const std::string &object, size_t bytes, const std::vector<std::shared_ptr<ClientHandle>> &holders)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto [it, added] = blobs.try_emplace(object);
+        if (added)
+            it->second.held = std::chrono::steady_clock::now();
+        it->second.bytes = bytes;
+        for (const std::shared_ptr<ClientHandle> &holder : holders)
+            it->second.holders.insert(holder->name);
+        if (it->second.holders.empty())
+            free_locked(it);
+    }
+
+    void release(const std::string &object, const std::string &holder)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = blobs.find(object);
+        if (it != blobs.end() && it->second.holders.erase(holder) && it->second.holders.empty())
+            free_locked(it);
+    }
+
+    // The client quit or timed out: drop every hold it still has.
+    void release_all(const std::string &holder)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto it = blobs.begin(); it != blobs.end();)
+        {
+            if (it->second.holders.erase(holder) && it->second.holders.empty())
+                it = free_locked(it);
+            else
+                ++it;
+        }
+    }
+
+    // Unlink blobs held since before cutoff, whoever still holds them.
+    void expire(std::chrono::steady_clock::time_point cutoff)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto it = blobs.begin(); it != blobs.end();)
+        {
+            if (it->second.held < cutoff)
+            {
+                expired_count++;
+                it = free_locked(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    // An accepted blob whose message was never sent.
+    void discard(const std::string &object)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (blobs.count(object))
+            return; // the same handle was sent before and is still held
+        shm_unlink(object.c_str());
+        freed_count++;
+    }
+
+    // Unlink whatever is still held, at shutdown.
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        while (!blobs.empty())
+            free_locked(blobs.begin());
+    }
+
+    size_t live()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return blobs.size();
+    }
+
+    uint64_t live_bytes()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t total = 0;
+        for (const auto &entry : blobs)
+            total += entry.second.bytes;
+        return total;
+    }
+
+    uint64_t freed()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return freed_count;
+    }
+
+    uint64_t expired()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return expired_count;
+    }
+
+    uint64_t rejected() const { return rejected_count.load(std::memory_order_relaxed); }
+
+private:
+    // read()/write() rather than mmap: the sender may shrink src under us,
+    // which ends the copy early instead of raising SIGBUS.
+    std::string copy_object(int src, size_t bytes)
+    {
+        std::string copy = "/chat_copy_" + std::to_string(getpid()) + "_" +
+                           std::to_string(copy_counter.fetch_add(1, std::memory_order_relaxed));
+        int dst = shm_open(copy.c_str(), O_RDWR | O_CREAT | O_EXCL, 0444);
+        if (dst == -1)
+            return "";
+
+        char buf[65536];
+        size_t done = 0;
+        bool ok = true;
+        while (ok && done < bytes)
+        {
+            ssize_t n = pread(src, buf, std::min(sizeof(buf), bytes - done), static_cast<off_t>(done));
+            ok = n > 0 && write(dst, buf, n) == n;
+            if (ok)
+                done += n;
+        }
+        close(dst);
+        if (!ok)
+        {
+            shm_unlink(copy.c_str());
+            return "";
+        }
+        return copy;
+    }
+
+    struct Blob
+    {
+        size_t bytes = 0;
+        std::unordered_set<std::string> holders;
+        std::chrono::steady_clock::time_point held; // first handed out
+    };
+    using BlobMap = std::unordered_map<std::string, Blob>;
+
+    BlobMap::iterator free_locked(BlobMap::iterator it)
+    {
+        shm_unlink(it->first.c_str());
+        freed_count++;
+        return blobs.erase(it);
+    }
+
+    std::mutex mtx;
+    BlobMap blobs;
+    uint64_t freed_count = 0;
+    uint64_t expired_count = 0;
+    std::atomic<uint64_t> rejected_count{0};
+    std::atomic<uint64_t> copy_counter{0};
+};
+
+BlobRegistry blob_registry;
+
+// Runs with --blob-ttl > 0: a recipient that never sends RELEASE only pins
+// a blob until then.
+void blob_sweeper()
+{
+    const std::chrono::seconds ttl(server_config.blob_ttl_s);
+    const std::chrono::seconds period = std::min<std::chrono::seconds>(ttl, std::chrono::seconds(10));
+    while (true)
+    {
+        std::this_thread::sleep_for(period);
+        blob_registry.expire(std::chrono::steady_clock::now() - ttl);
+    }
+}
+
+// If text is a valid blob handle from sender, take ownership of the blob
+// and set object/bytes to the server's copy; blob_handle(object, bytes) is
+// then the text to send on.
+bool accept_blob(const std::string &sender, std::string_view text, std::string &object, size_t &bytes)
+{
+    std::string theirs;
+    if (parse_blob_handle(text, theirs, bytes))
+        object = blob_registry.adopt(sender, theirs, bytes);
+    return !object.empty();
+}
+
+// ============================================================
+//  ADMISSION CONTROL
+// ============================================================
+//
+// With --rate-limit R every client may send R SAY/DM messages a second, in
+// bursts of up to --rate-burst. With --admit-depth D a SAY is refused while
+// its room's broadcast queue already holds D tasks, so a flooded shard sheds
+// load instead of growing its queue, and every room's latency with it.
+// Refused messages are not queued: the sender gets a "[Server]: ..." notice
+// at PRIO_CONTROL, at most one a second, counting what was refused since
+// the last one.
+
+std::atomic<uint64_t> refused_over_rate{0};
+std::atomic<uint64_t> refused_busy_room{0};
+
+void refuse_chat(ClientHandle &client, const std::string &reason)
+{
+    client.refused.fetch_add(1, std::memory_order_relaxed);
+    client.refused_unreported.fetch_add(1, std::memory_order_relaxed);
+
+    int64_t now = steady_ms();
+    int64_t next = client.next_notice_ms.load(std::memory_order_relaxed);
+    if (now < next || !client.next_notice_ms.compare_exchange_strong(next, now + 1000, std::memory_order_relaxed))
+        return;
+
+    uint64_t count = client.refused_unreported.exchange(0, std::memory_order_relaxed);
+    std::string notice = "[Server]: " + reason + ", " + std::to_string(count) +
+                         (count == 1 ? " message was" : " messages were") + " not delivered.";
+    deliver(client, notice.c_str(), notice.size() + 1, PRIO_CONTROL);
+}
+
+// Take one of the client's SAY/DM tokens, or refuse the message.
+bool within_rate(ClientHandle &client)
+{
+    if (server_config.rate_limit <= 0)
+        return true;
+
+    int64_t interval = static_cast<int64_t>(1e9 / server_config.rate_limit);
+    if (client.chat_tokens.take(steady_ns(), interval, server_config.rate_burst))
+        return true;
+
+    refused_over_rate.fetch_add(1, std::memory_order_relaxed);
+    std::ostringstream reason;
+    reason << "slow down, the limit is " << server_config.rate_limit << " messages a second";
+    refuse_chat(client, reason.str());
+    return false;
+}
+
+// Whether a SAY to room may be queued under --admit-depth.
+bool room_admits(const std::string &room)
+{
+    return server_config.admit_depth == 0 ||
+           broadcast_shards[room_shard(room)]->chat.size() < server_config.admit_depth;
+}
+
+// ============================================================
+//  BROADCASTER POOL
+// ============================================================
+//
+// Workers take shards off ready_shards and run each one until it is out of
+// work, or until it has had SHARD_TURN batches while other shards wait, and
+// then hand it back. The pool starts with one worker per core, within
+// --broadcast-min-workers and --broadcast-workers, and never has more
+// workers than there are shards. Every POOL_TICK a supervisor checks it:
+// a shard that has waited GROW_WAIT for a worker, or more queued chat than
+// a batch per worker, adds a worker; SHRINK_AFTER of mostly idle workers
+// retires one. A worker's utilisation is the share of wall time it spent
+// fanning out, smoothed over about a second.
+
+// Everyone in the room but the sender, as open queue handles. A
+// registered member's handle is in its slot, others may be in the handle
+// cache; members with neither go to unresolved, to be opened once the
+// caller has released registry_lock. Caller holds registry_lock.
+void room_recipients(const MemberBitmap &members, const std::string &sender,
+                     std::vector<std::shared_ptr<ClientHandle>> &out, std::vector<std::string> &unresolved)
+{
+    int sender_slot = client_directory.find(sender);
+    members.for_each([&](uint32_t slot)
+                     {
+        if (static_cast<int>(slot) == sender_slot)
+            return;
+        const ClientSlot &member = client_directory.at(slot);
+        if (member.handle && !member.handle->retired)
+            out.push_back(member.handle);
+        else if (std::shared_ptr<ClientHandle> handle = client_handles.find(member.name))
+            out.push_back(std::move(handle));
+        else
+            unresolved.push_back(member.name); });
+}
+
+// What a shard keeps between turns. Only the worker holding the shard
+// touches it.
+struct ShardCursor
+{
+    std::unordered_map<std::string, int> room_sequence;
+
+    // Messages for CAP_BATCH recipients are coalesced per recipient and sent
+    // as one mq message when the batch fills up or has lingered long enough.
+    struct PendingBatch
+    {
+        std::shared_ptr<ClientHandle> handle;
+        BatchWriter writer;
+        std::vector<std::string> blobs; // held by handle until the batch goes out
+    };
+    std::unordered_map<std::string, PendingBatch> pending;
+    std::chrono::steady_clock::time_point oldest_pending;
+};
+
+class BroadcasterPool
+{
+public:
+    void start(int min_workers, int max_workers, bool pin)
+    {
+        int cores = std::max(1u, std::thread::hardware_concurrency());
+        max_size = std::clamp(max_workers > 0 ? max_workers : cores, 1, NUM_BROADCAST_SHARDS);
+        min_size = std::clamp(min_workers, 1, max_size);
+        pin_workers = pin;
+        for (std::unique_ptr<Worker> &worker : workers)
+            worker.reset(new Worker);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        for (int i = std::clamp(cores, min_size, max_size); i > 0; --i)
+            grow();
+        supervisor = std::thread(&BroadcasterPool::supervise, this);
+    }
+
+    // Let the workers finish what is already queued, then stop them.
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (supervisor.joinable())
+            supervisor.join();
+
+        for (int i = active.exchange(0); i > 0; --i)
+            ready_shards.push(-1);
+        for (std::unique_ptr<Worker> &worker : workers)
+            if (worker->thread.joinable())
+                worker->thread.join();
+    }
+
+    int size() const { return active.load(std::memory_order_relaxed); }
+    int min() const { return min_size; }
+    int max() const { return max_size; }
+    uint64_t grown() const { return grow_count.load(std::memory_order_relaxed); }
+    uint64_t shrunk() const { return shrink_count.load(std::memory_order_relaxed); }
+
+    // (worker, utilisation in permille) for every running worker
+    std::vector<std::pair<int, int>> utilization() const
+    {
+        std::vector<std::pair<int, int>> out;
+        for (int i = 0; i < NUM_BROADCAST_SHARDS; ++i)
+            if (workers[i] && workers[i]->running.load(std::memory_order_relaxed))
+                out.emplace_back(i, workers[i]->utilization.load(std::memory_order_relaxed));
+        return out;
+    }
+
+private:
+    static constexpr auto POOL_TICK = std::chrono::milliseconds(100);
+    static constexpr int64_t GROW_WAIT_NS = 2000000;
+    static constexpr int SHRINK_BELOW_PERMILLE = 200;
+    static constexpr int SHRINK_AFTER_TICKS = 50;
+    static constexpr int SHARD_TURN = 8;
+
+    struct Worker
+    {
+        std::thread thread;
+        std::atomic<bool> running{false};   // started and not yet retired
+        std::atomic<int64_t> busy_ns{0};    // time spent running shards
+        int64_t busy_seen = 0;              // busy_ns at the supervisor's last tick
+        std::atomic<int> utilization{0};    // permille
+
+        // only touched by the worker's own thread
+        std::vector<BroadcastTask> batch;
+        std::vector<std::shared_ptr<ClientHandle>> recipients;
+        std::vector<std::string> unresolved;
+    };
+
+    // Start a worker in a free slot. Caller holds mtx.
+    void grow()
+    {
+        for (int i = 0; i < NUM_BROADCAST_SHARDS; ++i)
+        {
+            Worker &worker = *workers[i];
+            if (worker.running.load())
+                continue;
+            if (worker.thread.joinable())
+                worker.thread.join(); // retired earlier
+            worker.running = true;
+            worker.busy_ns = 0;
+            worker.busy_seen = 0;
+            worker.utilization = 0;
+            worker.thread = std::thread(&BroadcasterPool::work, this, i);
+            if (pin_workers)
+                pin(worker.thread, i);
+            active++;
+            return;
+        }
+    }
+
+    // Whichever worker next goes idle takes the -1 and exits.
+    void shrink()
+    {
+        active--;
+        ready_shards.push(-1);
+    }
+
+    static void pin(std::thread &thread, int index)
+    {
+        int cpu = index % std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0)
+            log_warn("[SYSTEM] Could not pin broadcaster ", index, " to CPU ", cpu);
+    }
+
+    void supervise()
+    {
+        int idle_ticks = 0;
+        int64_t last_tick = steady_ns();
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!cv.wait_for(lock, POOL_TICK, [this]
+                            { return stopping.load(); }))
+        {
+            int64_t now = steady_ns();
+            int64_t wall = std::max<int64_t>(1, now - last_tick);
+            last_tick = now;
+
+            int total = 0, running = 0;
+            for (std::unique_ptr<Worker> &slot : workers)
+            {
+                Worker &worker = *slot;
+                if (!worker.running.load())
+                    continue;
+                int64_t busy = worker.busy_ns.load(std::memory_order_relaxed);
+                int tick = static_cast<int>(std::min<int64_t>(1000, (busy - worker.busy_seen) * 1000 / wall));
+                worker.busy_seen = busy;
+                int smoothed = worker.utilization.load(std::memory_order_relaxed);
+                smoothed += (tick - smoothed) / 10;
+                worker.utilization.store(smoothed, std::memory_order_relaxed);
+                total += smoothed;
+                running++;
+            }
+
+            size_t queued = 0;
+            int64_t longest_wait = 0;
+            for (const std::unique_ptr<BroadcastShard> &shard : broadcast_shards)
+            {
+                queued += shard->chat.size();
+                int64_t since = shard->ready_since_ns.load(std::memory_order_relaxed);
+                if (since != 0)
+                    longest_wait = std::max(longest_wait, now - since);
+            }
+
+            int workers_now = active.load();
+            if (longest_wait >= GROW_WAIT_NS || queued > workers_now * server_config.broadcast_batch)
+            {
+                idle_ticks = 0;
+                if (workers_now < max_size)
+                {
+                    grow();
+                    grow_count++;
+                    log_info("[SYSTEM] Broadcaster pool grew to ", active.load(), " (queued=", queued,
+                             " longest shard wait=", longest_wait / 1000, " us)");
+                }
+            }
+            else if (running > 0 && total / running < SHRINK_BELOW_PERMILLE)
+            {
+                if (++idle_ticks >= SHRINK_AFTER_TICKS && workers_now > min_size)
+                {
+                    idle_ticks = 0;
+                    shrink();
+                    shrink_count++;
+                    log_info("[SYSTEM] Broadcaster pool shrank to ", active.load());
+                }
+            }
+            else
+            {
+                idle_ticks = 0;
+            }
+        }
+    }
+
+    void work(int index)
+    {
+        Worker &me = *workers[index];
+        log_debug("Broadcaster thread ", std::this_thread::get_id(), " started (worker ", index, ").");
+        me.batch.reserve(server_config.broadcast_batch);
+
+        std::vector<int> claimed;
+        while (true)
+        {
+            claimed.clear();
+            if (ready_shards.pop_batch(claimed, 1) == 0)
+                continue;
+            int shard = claimed[0];
+            if (shard < 0)
+                break;
+            int64_t since = broadcast_shards[shard]->ready_since_ns.exchange(0, std::memory_order_relaxed);
+            if (since != 0)
+                record_metric(M_SHARD_WAIT, static_cast<uint64_t>(steady_ns() - since));
+            run_shard(shard, me);
+        }
+
+        me.running = false;
+        log_debug("Broadcaster thread ", std::this_thread::get_id(), " retired (worker ", index, ").");
+    }
+
+    // Give the shard back. Returns false if work arrived meanwhile and
+    // nobody else had scheduled it, in which case the caller still holds it.
+    static bool release_shard(BroadcastShard &shard)
+    {
+        shard.scheduled.store(false, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return shard.idle() || shard.scheduled.exchange(true);
+    }
+
+    void run_shard(int index, Worker &me)
+    {
+        BroadcastShard &lanes = *broadcast_shards[index];
+        ShardCursor &cursor = cursors[index];
+        const auto linger = std::chrono::microseconds(server_config.batch_linger_us);
+        const size_t max_batch = server_config.broadcast_batch;
+        int turn = 0;
+
+        // Busy time is credited as it accrues, so a shard that keeps its
+        // worker for a long time still shows up in the utilisation.
+        int64_t mark = steady_ns();
+        auto account = [&]()
+        {
+            int64_t now = steady_ns();
+            me.busy_ns.fetch_add(now - mark, std::memory_order_relaxed);
+            mark = now;
+        };
+
+        while (true)
+        {
+            // The control lane first, every time round.
+            me.batch.clear();
+            if (lanes.control.try_pop_batch(me.batch, max_batch) == 0 &&
+                lanes.chat.try_pop_batch(me.batch, max_batch) == 0)
+            {
+                // Out of work. Partial batches may linger, but only while no
+                // other shard is waiting for a worker. A control task
+                // interrupts the wait.
+                bool more = false;
+                if (!cursor.pending.empty() && ready_shards.size() == 0)
+                {
+                    account();
+                    more = lanes.chat.pop_batch_until(me.batch, max_batch, cursor.oldest_pending + linger) > 0;
+                    mark = steady_ns(); // lingering is not work
+                }
+                if (!more)
+                {
+                    flush_all(cursor);
+                    if (release_shard(lanes))
+                        break;
+                    continue;
+                }
+            }
+
+            fan_out(me, lanes, cursor);
+
+            if (!cursor.pending.empty() && std::chrono::steady_clock::now() - cursor.oldest_pending >= linger)
+                flush_all(cursor);
+            account();
+
+            if (++turn >= SHARD_TURN && ready_shards.size() > 0 && !stopping)
+            {
+                // others are waiting: go to the back of the line, still scheduled
+                flush_all(cursor);
+                lanes.ready_since_ns.store(steady_ns(), std::memory_order_relaxed);
+                ready_shards.push(int(index));
+                break;
+            }
+        }
+        account();
+    }
+
+    static void flush(ShardCursor::PendingBatch &p)
+    {
+        if (p.writer.empty())
+            return;
+        if (!deliver(*p.handle, p.writer.bytes().data(), p.writer.bytes().size()))
+            for (const std::string &blob : p.blobs) // never saw the handle, so never releases it
+                blob_registry.release(blob, p.handle->name);
+        p.writer.clear();
+        p.blobs.clear();
+    }
+
+    static void flush_all(ShardCursor &cursor)
+    {
+        for (auto &entry : cursor.pending)
+            flush(entry.second);
+        cursor.pending.clear();
+    }
+
+    // Sequence, log and deliver one batch of tasks.
+    void fan_out(Worker &me, BroadcastShard &lanes, ShardCursor &cursor)
+    {
+        auto popped = std::chrono::steady_clock::now();
+        record_metric(M_QUEUE_DEPTH, lanes.chat.size());
+        for (BroadcastTask &task : me.batch)
+        {
+            broadcast_count.fetch_add(1, std::memory_order_relaxed);
+            record_metric(M_QUEUE_WAIT, popped - task.queued);
+            auto sequence = cursor.room_sequence.find(task.target_room);
+            if (sequence == cursor.room_sequence.end()) // first message since start: continue the room's log
+                sequence = cursor.room_sequence.emplace(task.target_room, message_log.last_seq(task.target_room)).first;
+            task.sequence_id = ++sequence->second;
+
+            char tag[Payload::HEADROOM];
+            int tag_len = std::snprintf(tag, sizeof(tag), "[SEQ:%d] ", task.sequence_id);
+            task.message_payload.prepend(std::string_view(tag, tag_len));
+            const Payload &payload = task.message_payload;
+            if (message_log.enabled())
+                message_log.append(task.target_room, task.sequence_id, payload);
+
+            // Only the recipient list is taken under the lock; the sends
+            // happen after it is released so JOIN/LEAVE/QUIT never wait on
+            // a fan-out.
+            std::vector<std::shared_ptr<ClientHandle>> &recipients = me.recipients;
+            {
+                ReadLock lock(registry_lock);
+                auto members = room_members.find(task.target_room);
+                if (members == room_members.end())
+                {
+                    if (!task.blob.empty())
+                        blob_registry.discard(task.blob);
+                    continue;
+                }
+                auto fanned = room_fanned.find(task.target_room);
+                if (fanned != room_fanned.end())
+                    fanned->second.store(task.sequence_id);
+                room_recipients(members->second, task.sender_name, recipients, me.unresolved);
+            }
+            for (const std::string &name : me.unresolved) // mq_open outside the lock
+                if (std::shared_ptr<ClientHandle> handle = client_handles.get(name))
+                    recipients.push_back(std::move(handle));
+            me.unresolved.clear();
+            if (!task.blob.empty()) // before anyone can see the handle and release it
+                blob_registry.hold(task.blob, task.blob_bytes, recipients);
+
+            // CAP_ROOMS recipients get "[#room] " in front; built on first use
+            Payload tagged;
+            for (const std::shared_ptr<ClientHandle> &handle : recipients)
+            {
+                const Payload *line = &payload;
+                if (handle->caps & CAP_ROOMS)
+                {
+                    if (tagged.empty())
+                        tagged = Payload::concat({"[#", task.target_room, "] ", payload.view()});
+                    line = &tagged;
+                }
+
+                // control notices are never held back in a batch
+                if (!(handle->caps & CAP_BATCH) || task.priority != PRIO_CHAT ||
+                    BATCH_HEADER + BATCH_RECORD_HEADER + line->size() > server_config.batch_bytes)
+                {
+                    if (!deliver(*handle, line->data(), line->size() + 1, task.priority) && !task.blob.empty())
+                        blob_registry.release(task.blob, handle->name);
+                    continue;
+                }
+
+                auto it = cursor.pending.find(handle->name);
+                if (it == cursor.pending.end())
+                {
+                    if (cursor.pending.empty())
+                        cursor.oldest_pending = std::chrono::steady_clock::now();
+                    it = cursor.pending.emplace(handle->name, ShardCursor::PendingBatch{handle, BatchWriter(server_config.batch_bytes)}).first;
+                }
+                if (!it->second.writer.add(line->view()))
+                {
+                    flush(it->second);
+                    it->second.writer.add(line->view());
+                }
+                if (!task.blob.empty())
+                    it->second.blobs.push_back(task.blob);
+            }
+            record_metric(M_FANOUT, recipients.size());
+            recipients.clear(); // don't pin the handles of clients that quit
+        }
+    }
+
+    std::unique_ptr<Worker> workers[NUM_BROADCAST_SHARDS];
+    ShardCursor cursors[NUM_BROADCAST_SHARDS];
+    std::atomic<int> active{0}; // workers not yet told to retire
+    int min_size = 1;
+    int max_size = 1;
+    bool pin_workers = false;
+    std::atomic<uint64_t> grow_count{0};
+    std::atomic<uint64_t> shrink_count{0};
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread supervisor;
+    std::atomic<bool> stopping{false};
+};
+
+BroadcasterPool broadcaster_pool;
+
+// ============================================================
+//  DIRECT MESSAGES
+// ============================================================
+//
+// A DM leaves the receive thread as soon as it is parsed: send_dm puts it
+// in the recipient's mailbox and the DM thread does the rest, so opening
+// the recipient's queue or finding it full never holds up ingest. A mailbox
+// takes --dm-mailbox messages; past that the sender is refused, as for chat
+// over the rate limit. The DM thread empties one mailbox at a time and
+// packs it into batched mq messages for CAP_BATCH recipients.
+//
+// The mailbox of a client that quit or timed out is held for --dm-hold-ms
+// in case it comes back; REGISTER sends what is waiting and otherwise it is
+// given up on. A DM for anyone else who is not registered is offline at
+// once and never gets a mailbox, and a drained mailbox is dropped, so the
+// map only holds recipients with DMs waiting.
+
+struct DirectMessage
+{
+    std::string sender;
+    std::string line; // "[DM from alice]: ...", what the recipient sees
+    std::string blob; // shared-memory blob in the message, if any
+    size_t blob_bytes = 0;
+    std::chrono::steady_clock::time_point queued;
+    bool held = false; // the sender has been told it is queued
+};
+
+class DmRouter
+{
+public:
+    enum Outcome
+    {
+        DELIVERED,
+        QUEUED,
+        DROPPED,
+        OFFLINE,
+        OUTCOMES
+    };
+
+    enum Admission
+    {
+        ACCEPTED,
+        MAILBOX_FULL,
+        NOT_REGISTERED // and not held for either
+    };
+
+    void start() { std::thread(&DmRouter::run, this).detach(); }
+
+    // Takes dm only if ACCEPTED. Only registered clients, and those held
+    // for after leaving, get a mailbox.
+    Admission submit(const std::string &target, DirectMessage &&dm)
+    {
+        bool registered;
+        {
+            ReadLock lock(registry_lock);
+            registered = client_queues.count("/client_" + target) > 0;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = mailboxes.find(target);
+            if (it == mailboxes.end())
+            {
+                if (!registered && !departed.count(target))
+                {
+                    outcomes[OFFLINE].fetch_add(1, std::memory_order_relaxed);
+                    return NOT_REGISTERED;
+                }
+                it = mailboxes.emplace(target, Mailbox()).first;
+            }
+            Mailbox &box = it->second;
+            if (box.messages.size() >= server_config.dm_mailbox)
+            {
+                refused_count++;
+                return MAILBOX_FULL;
+            }
+            box.messages.push_back(std::move(dm));
+            waiting_count++;
+            if (box.scheduled)
+                return ACCEPTED;
+            box.scheduled = true;
+            ready.push_back(target);
+        }
+        cv.notify_one();
+        return ACCEPTED;
+    }
+
+    // The client has registered: send whatever was held for it.
+    void online(const std::string &name)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            departed.erase(name);
+            auto it = mailboxes.find(name);
+            if (it == mailboxes.end() || it->second.scheduled)
+                return;
+            it->second.scheduled = true;
+            ready.push_back(name);
+        }
+        cv.notify_one();
+    }
+
+    // The client quit or timed out: hold its DMs for --dm-hold-ms. Called
+    // before it stops counting as registered, so no DM falls in between.
+    void offline(const std::string &name)
+    {
+        if (server_config.dm_hold_ms <= 0)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        departed[name] = std::chrono::steady_clock::now();
+    }
+
+    // Tell sender what became of a DM that never reached a mailbox.
+    static void report(const std::string &sender, const std::string &target, Outcome outcome)
+    {
+        send_statuses({Status{sender, target, outcome, 1}});
+    }
+
+    uint64_t count(Outcome outcome) const { return outcomes[outcome].load(std::memory_order_relaxed); }
+    uint64_t refused() const { return refused_count.load(std::memory_order_relaxed); }
+
+    size_t waiting()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return waiting_count;
+    }
+
+private:
+    static constexpr std::chrono::milliseconds SWEEP{100}; // how often held mailboxes are checked
+
+    struct Mailbox
+    {
+        std::deque<DirectMessage> messages;
+        bool scheduled = false; // on the ready list
+    };
+
+    // One status line covers a run of DMs from a sender with one outcome.
+    struct Status
+    {
+        std::string sender;
+        std::string target;
+        Outcome outcome;
+        size_t count;
+    };
+
+    static const char *outcome_name(Outcome outcome)
+    {
+        static const char *const names[OUTCOMES] = {"delivered", "queued", "dropped", "offline"};
+        return names[outcome];
+    }
+
+    void run()
+    {
+        std::vector<DirectMessage> batch;
+        std::vector<Status> statuses;
+        while (true)
+        {
+            std::string target;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait_for(lock, SWEEP, [this]
+                            { return !ready.empty(); });
+                expire_locked(statuses);
+                if (!ready.empty())
+                {
+                    target = std::move(ready.front());
+                    ready.pop_front();
+                    take_locked(target, batch, statuses);
+                }
+            }
+
+            if (!batch.empty())
+                deliver_all(target, batch, statuses);
+            send_statuses(statuses);
+            batch.clear();
+            statuses.clear();
+        }
+    }
+
+    // Take a scheduled mailbox's messages, or mark them held if its client
+    // has left. Caller holds mtx.
+    void take_locked(const std::string &target, std::vector<DirectMessage> &batch, std::vector<Status> &statuses)
+    {
+        auto it = mailboxes.find(target);
+        if (it == mailboxes.end())
+            return;
+        Mailbox &box = it->second;
+        box.scheduled = false;
+
+        if (departed.count(target))
+        {
+            for (DirectMessage &dm : box.messages)
+                if (!dm.held)
+                {
+                    dm.held = true;
+                    add_status(statuses, dm.sender, target, QUEUED);
+                }
+            return;
+        }
+
+        for (DirectMessage &dm : box.messages)
+            batch.push_back(std::move(dm));
+        waiting_count -= box.messages.size();
+        mailboxes.erase(it);
+    }
+
+    // Give up on the mailboxes of clients that left more than --dm-hold-ms
+    // ago. Caller holds mtx.
+    void expire_locked(std::vector<Status> &statuses)
+    {
+        auto cutoff = std::chrono::steady_clock::now() - std::chrono::milliseconds(server_config.dm_hold_ms);
+        for (auto it = departed.begin(); it != departed.end();)
+        {
+            if (it->second > cutoff)
+            {
+                ++it;
+                continue;
+            }
+            auto box = mailboxes.find(it->first);
+            if (box != mailboxes.end() && !box->second.scheduled)
+            {
+                for (DirectMessage &dm : box->second.messages)
+                {
+                    add_status(statuses, dm.sender, it->first, OFFLINE);
+                    if (!dm.blob.empty())
+                        blob_registry.discard(dm.blob);
+                }
+                outcomes[OFFLINE].fetch_add(box->second.messages.size(), std::memory_order_relaxed);
+                waiting_count -= box->second.messages.size();
+                mailboxes.erase(box);
+            }
+            it = departed.erase(it);
+        }
+    }
+
+    void deliver_all(const std::string &target, std::vector<DirectMessage> &batch, std::vector<Status> &statuses)
+    {
+        // cached handles only: never reopen the queue of a client that has quit
+        std::shared_ptr<ClientHandle> handle = client_handles.find(target);
+        auto finish = [&](DirectMessage &dm, Outcome outcome)
+        {
+            if (outcome == OFFLINE && !dm.blob.empty())
+                blob_registry.discard(dm.blob);
+            else if (outcome == DROPPED && !dm.blob.empty())
+                blob_registry.release(dm.blob, target); // held below, but never seen
+            if (outcome == DELIVERED || outcome == QUEUED)
+                record_metric(M_DM_WAIT, std::chrono::steady_clock::now() - dm.queued);
+            outcomes[outcome].fetch_add(1, std::memory_order_relaxed);
+            add_status(statuses, dm.sender, target, outcome);
+        };
+        auto outcome_of = [&](bool sent)
+        {
+            if (!sent)
+                return DROPPED;
+            return handle->pending_bytes.load(std::memory_order_relaxed) > 0 ? QUEUED : DELIVERED;
+        };
+
+        if (!handle)
+        {
+            for (DirectMessage &dm : batch)
+                finish(dm, OFFLINE);
+            return;
+        }
+        for (DirectMessage &dm : batch) // before the recipient can see the handle and release it
+            if (!dm.blob.empty())
+                blob_registry.hold(dm.blob, dm.blob_bytes, {handle});
+
+        if (!(handle->caps & CAP_BATCH))
+        {
+            for (DirectMessage &dm : batch)
+                finish(dm, outcome_of(deliver(*handle, dm.line.c_str(), dm.line.size() + 1)));
+            return;
+        }
+
+        // batched: every DM in a batch shares its outcome
+        BatchWriter writer(server_config.batch_bytes);
+        size_t first = 0; // first DM in the writer
+        auto flush = [&](size_t end)
+        {
+            if (writer.empty())
+                return;
+            Outcome outcome = outcome_of(deliver(*handle, writer.bytes().data(), writer.bytes().size()));
+            for (size_t i = first; i < end; ++i)
+                finish(batch[i], outcome);
+            writer.clear();
+        };
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            DirectMessage &dm = batch[i];
+            if (!writer.fits_alone(dm.line.size()))
+            {
+                flush(i);
+                finish(dm, outcome_of(deliver(*handle, dm.line.c_str(), dm.line.size() + 1)));
+                first = i + 1;
+                continue;
+            }
+            if (!writer.add(dm.line))
+            {
+                flush(i);
+                first = i;
+                writer.add(dm.line);
+            }
+        }
+        flush(batch.size());
+    }
+
+    static void add_status(std::vector<Status> &statuses, const std::string &sender, const std::string &target,
+                           Outcome outcome)
+    {
+        if (!statuses.empty() && statuses.back().outcome == outcome && statuses.back().sender == sender &&
+            statuses.back().target == target)
+            statuses.back().count++;
+        else
+            statuses.push_back(Status{sender, target, outcome, 1});
+    }
+
+    static void send_statuses(const std::vector<Status> &statuses)
+    {
+        for (const Status &status : statuses)
+        {
+            std::shared_ptr<ClientHandle> sender = client_handles.find(status.sender);
+            std::string text;
+            if (sender && (sender->caps & CAP_DM_STATUS))
+            {
+                text = "[DM to " + status.target + "]: ";
+                if (status.count > 1)
+                    text += std::to_string(status.count) + " ";
+                text += outcome_name(status.outcome);
+            }
+            else if (status.outcome == OFFLINE)
+                text = "[Server]: user '" + status.target + "' not found.";
+            else
+                continue;
+
+            if (sender)
+                deliver(*sender, text.c_str(), text.size() + 1, PRIO_CONTROL);
+            else
+                send_to_client(status.sender, text);
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::unordered_map<std::string, Mailbox> mailboxes;
+    std::deque<std::string> ready; // mailboxes waiting for the DM thread
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> departed;
+    size_t waiting_count = 0;
+
+    std::atomic<uint64_t> outcomes[OUTCOMES] = {};
+    std::atomic<uint64_t> refused_count{0};
+};
+
+DmRouter dm_router;
+
+// ============================================================
+//  STATS REPORTER
+// ============================================================
+//
+// stats_lines() renders every metric as text. The same lines are logged as
+// [STATS] every --stats-interval, returned by the STATS command and
+// published to the shared-memory stats page every --stats-page-ms.
+
+std::string format_ns(uint64_t ns)
+{
+    char buf[32];
+    if (ns < 1000)
+        std::snprintf(buf, sizeof(buf), "%lluns", static_cast<unsigned long long>(ns));
+    else if (ns < 1000000)
+        std::snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        std::snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+    else
+        std::snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+    return buf;
+}
+
+// "<label>: n=... mean=... p50=... p90=... p99=... p99.9=... max=...", or
+// nothing if the metric is empty and skip_empty is set.
+std::string histogram_line(const std::string &label, Metric metric, bool latency, bool skip_empty = false)
+{
+    Histogram merged;
+    metrics.merged(metric, merged);
+    if (skip_empty && merged.count() == 0)
+        return std::string();
+    auto value = [latency](uint64_t v)
+    { return latency ? format_ns(v) : std::to_string(v); };
+
+    std::string line = label + ": n=" + std::to_string(merged.count());
+    if (merged.count() == 0)
+        return line;
+    char mean[32];
+    std::snprintf(mean, sizeof(mean), "%.1f", merged.mean());
+    line += " mean=" + (latency ? format_ns(static_cast<uint64_t>(merged.mean())) : std::string(mean)) + " p50=" + value(merged.quantile(0.5)) +
+            " p90=" + value(merged.quantile(0.9)) + " p99=" + value(merged.quantile(0.99)) +
+            " p99.9=" + value(merged.quantile(0.999)) + " max=" + value(merged.max());
+    return line;
+}
+
+std::vector<std::string> stats_lines()
+{
+    std::vector<std::string> lines;
+    std::ostringstream line;
+    auto emit = [&]()
+    {
+        lines.push_back(line.str());
+        line.str("");
+    };
+
+    line << "client queue descriptors: reused=" << client_handles.reused()
+         << " reopened=" << client_handles.reopened()
+         << " heartbeat wheel entries=" << heartbeat_wheel.size();
+    emit();
+
+    size_t depth = 0, deepest = 0, high_water = 0, control = 0;
+    uint64_t dropped = 0, rejected = 0;
+    for (const auto &shard : broadcast_shards)
+    {
+        depth += shard->chat.size();
+        deepest = std::max(deepest, shard->chat.size());
+        high_water = std::max(high_water, shard->chat.high_water());
+        dropped += shard->chat.dropped();
+        rejected += shard->chat.rejected();
+        control += shard->control.size();
+    }
+    line << "broadcast queues: depth=" << depth << " deepest=" << deepest << " high_water=" << high_water
+         << " dropped=" << dropped << " rejected=" << rejected << " control=" << control;
+    emit();
+    line << "broadcast workers: active=" << broadcaster_pool.size() << " min=" << broadcaster_pool.min()
+         << " max=" << broadcaster_pool.max() << " grown=" << broadcaster_pool.grown()
+         << " shrunk=" << broadcaster_pool.shrunk() << " utilization:";
+    for (const auto &[worker, permille] : broadcaster_pool.utilization())
+        line << " w" << worker << "=" << permille / 10 << "%";
+    emit();
+    lines.push_back(histogram_line("broadcast shard wait for a worker", M_SHARD_WAIT, true));
+    lines.push_back(histogram_line("broadcast queue wait", M_QUEUE_WAIT, true));
+    lines.push_back(histogram_line("broadcast queue depth at pop", M_QUEUE_DEPTH, false));
+    lines.push_back(histogram_line("fan-out recipients", M_FANOUT, false));
+    line << "WHO rosters: cached replies=" << room_rosters.hits() << " rebuilt=" << room_rosters.builds();
+    emit();
+    {
+        ReadLock lock(registry_lock);
+        line << "client slots: used=" << client_directory.size() << " allocated=" << client_directory.capacity();
+    }
+    emit();
+
+    for (int op = 0; op < OP_COUNT; ++op)
+    {
+        std::string handler = histogram_line(std::string("handler ") + handler_names[op],
+                                             static_cast<Metric>(M_HANDLER + op), true, true);
+        if (!handler.empty())
+            lines.push_back(handler);
+    }
+
+    line << "client send failures:";
+    std::vector<std::pair<int, uint64_t>> errors = metrics.send_errors();
+    if (errors.empty())
+        line << " none";
+    for (const auto &error : errors)
+    {
+        const char *name = errno_name(error.first);
+        if (name)
+            line << ' ' << name << '=' << error.second;
+        else
+            line << " errno " << error.first << '=' << error.second;
+    }
+    emit();
+
+    if (message_log.enabled())
+    {
+        line << "message log: queued=" << message_log.backlog() << " index queued=" << search_index.backlog();
+        emit();
+        lines.push_back(histogram_line("search", M_SEARCH, true));
+    }
+
+    if (server_config.rate_limit > 0 || server_config.admit_depth > 0)
+    {
+        line << "admission: refused over rate=" << refused_over_rate.load()
+             << " refused busy room=" << refused_busy_room.load();
+        emit();
+    }
+
+    line << "direct messages: delivered=" << dm_router.count(DmRouter::DELIVERED)
+         << " queued=" << dm_router.count(DmRouter::QUEUED) << " dropped=" << dm_router.count(DmRouter::DROPPED)
+         << " offline=" << dm_router.count(DmRouter::OFFLINE) << " refused=" << dm_router.refused()
+         << " waiting=" << dm_router.waiting();
+    emit();
+    lines.push_back(histogram_line("DM wait", M_DM_WAIT, true));
+
+    if (size_t blobs = blob_registry.live(); blobs || blob_registry.freed() || blob_registry.rejected())
+    {
+        line << "blobs: live=" << blobs << " bytes=" << blob_registry.live_bytes()
+             << " freed=" << blob_registry.freed() << " expired=" << blob_registry.expired()
+             << " rejected=" << blob_registry.rejected();
+        emit();
+    }
+
+    for (const std::shared_ptr<ClientHandle> &client : client_handles.snapshot())
+    {
+        if (!client->dropped_newest && !client->dropped_oldest && !client->spilled && !client->refused)
+            continue;
+        line << "client " << client->name << " (" << client_overflow_name(client->overflow)
+             << "): dropped_newest=" << client->dropped_newest
+             << " dropped_oldest=" << client->dropped_oldest
+             << " spilled=" << client->spilled
+             << " redelivered=" << client->redelivered
+             << " pending_bytes=" << client->pending_bytes
+             << " refused=" << client->refused;
+        emit();
+    }
+
+    if (traffic_capture.enabled())
+    {
+        line << "capture: written=" << traffic_capture.written() << " queued=" << traffic_capture.backlog()
+             << " dropped=" << traffic_capture.dropped();
+        emit();
+    }
+
+    line << "egress reactor: parked=" << egress_reactor.parked_clients();
+    emit();
+    lines.push_back(histogram_line("egress flush latency", M_FLUSH_LATENCY, true));
+
+    line << "logger: queued=" << logger.backlog() << " dropped=" << logger.dropped();
+    emit();
+
+#ifdef CHAT_COUNT_ALLOCS
+    uint64_t messages = broadcast_count.load();
+    if (messages > 0)
+    {
+        line << "heap allocations: total=" << allocation_count.load()
+             << " per broadcast message=" << double(allocation_count.load()) / messages;
+        emit();
+    }
+#endif
+    return lines;
+}
+
+void stats_reporter()
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(server_config.stats_interval_s));
+        if (!logger.enabled(LogLevel::Info))
+            continue;
+        for (const std::string &line : stats_lines())
+            log_info("[STATS] ", line);
+    }
+}
+
+// Writer side of the page described in protocol.h.
+class StatsPage
+{
+public:
+    bool open()
+    {
+        int fd = shm_open(STATS_PAGE_NAME, O_CREAT | O_RDWR, 0644);
+        if (fd == -1)
+            return false;
+        size_t len = sizeof(StatsPageHeader) + STATS_PAGE_BYTES;
+        void *p = ftruncate(fd, len) == 0 ? mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+
+        hdr = new (p) StatsPageHeader();
+        hdr->magic = STATS_MAGIC;
+        text = static_cast<char *>(p) + sizeof(StatsPageHeader);
+        return true;
+    }
+
+    void publish(const std::string &page)
+    {
+        uint64_t version = hdr->version.load(std::memory_order_relaxed);
+        hdr->version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        size_t len = std::min(page.size(), STATS_PAGE_BYTES);
+        std::memcpy(text, page.data(), len);
+        hdr->length.store(static_cast<uint32_t>(len), std::memory_order_relaxed);
+        hdr->updated_ms.store(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::system_clock::now().time_since_epoch())
+                                  .count(),
+                              std::memory_order_relaxed);
+
+        hdr->version.store(version + 2, std::memory_order_release);
+    }
+
+private:
+    StatsPageHeader *hdr = nullptr;
+    char *text = nullptr;
+};
+
+void stats_publisher()
+{
+    StatsPage page;
+    if (!page.open())
+    {
+        log_warn("[SYSTEM] cannot create ", STATS_PAGE_NAME, ", the stats page is off.");
+        return;
+    }
+
+    std::string text;
+    while (true)
+    {
+        text.clear();
+        for (const std::string &line : stats_lines())
+        {
+            text += line;
+            text += '\n';
+        }
+        page.publish(text);
+        std::this_thread::sleep_for(std::chrono::milliseconds(server_config.stats_page_ms));
+    }
+}
+
+// ============================================================
+//  HANDLER FUNCTIONS
+// ============================================================
+//
+// Each command has one implementation below; the text parsers and the
+// binary frame handlers both decode their arguments and call into it.
+
+void register_client(const std::string &client_name, uint32_t caps, ClientOverflow overflow)
+{
+    uint32_t id = name_id(client_name);
+    std::shared_ptr<ClientHandle> handle = client_handles.open(client_name, caps, overflow);
+    {
+        WriteLock lock(registry_lock);
+        client_queues.insert("/client_" + client_name);
+        client_directory.acquire(client_name);
+        client_directory.entry(client_name)->handle = handle;
+
+        auto it = client_ids.find(id);
+        if (it != client_ids.end() && it->second != client_name)
+            log_warn("[SYSTEM] id collision between ", it->second, " and ", client_name,
+                     "; binary frames from ", client_name, " will be ignored.");
+        else
+            client_ids[id] = client_name;
+    }
+
+    touch_heartbeat(client_name);
+    dm_router.online(client_name);
+    log_info("/client_", client_name, " has joined the server!");
+}
+
+// Without CAP_ROOMS a JOIN moves the client out of its other rooms.
+// Joining a room the client is already in only makes it the current one.
+void join_room(const std::string &name, const std::string &room, const BacklogRequest &backlog)
+{
+    std::shared_ptr<ClientHandle> known = client_handles.find(name);
+    bool many_rooms = known && (known->caps & CAP_ROOMS);
+
+    // A room's first JOIN opens its log, which may mean scanning every
+    // segment: do that before taking the lock for writing.
+    bool seen;
+    {
+        ReadLock lock(registry_lock);
+        seen = room_fanned.count(room) != 0;
+    }
+    int logged = seen ? 0 : message_log.last_seq(room);
+
+    int not_live; // every seq up to here was fanned out before we joined
+    bool joined;
+    {
+        WriteLock lock(registry_lock);
+
+        if (!many_rooms)
+            if (ClientSlot *client = client_directory.entry(name))
+                for (const std::string &other : std::vector<std::string>(client->rooms))
+                    if (other != room)
+                        remove_from_room(name, other);
+        joined = add_to_room(name, room, logged);
+        room_ids[name_id(room)] = room;
+        not_live = room_fanned.find(room)->second.load();
+    }
+
+    // after the lock: a full control lane waits for workers that need it
+    if (joined)
+    {
+        BroadcastTask task;
+        task.message_payload = Payload::concat({"[SYSTEM]: ", name, " has joined #", room});
+        task.sender_name = name;
+        task.target_room = room;
+        task.priority = PRIO_CONTROL;
+        enqueue_broadcast(std::move(task));
+    }
+
+    if (!backlog.wanted() || !message_log.enabled())
+        return;
+    int from = backlog.since > 0 ? backlog.since + 1 : not_live - backlog.last + 1;
+    std::shared_ptr<ClientHandle> handle = client_handles.get(name);
+    if (handle && from <= not_live)
+        backlog_replayer.submit(handle, room, from, not_live);
+}
+
+// Runs on the receive thread: only checks the sender and hands the DM to
+// the DM thread (see DIRECT MESSAGES).
+void send_dm(const std::string &sender, const std::string &target, std::string_view message)
+{
+    DirectMessage dm;
+    accept_blob(sender, message, dm.blob, dm.blob_bytes);
+
+    std::shared_ptr<ClientHandle> from = client_handles.find(sender);
+    if (from && !within_rate(*from))
+    {
+        if (!dm.blob.empty())
+            blob_registry.discard(dm.blob);
+        return;
+    }
+
+    dm.sender = sender;
+    dm.line = "[DM from " + sender + "]: ";
+    if (dm.blob.empty())
+        dm.line.append(message.data(), message.size());
+    else
+        dm.line += blob_handle(dm.blob, dm.blob_bytes);
+    dm.queued = std::chrono::steady_clock::now();
+    std::string blob = dm.blob;
+    DmRouter::Admission admission = dm_router.submit(target, std::move(dm));
+    if (admission != DmRouter::ACCEPTED)
+    {
+        if (!blob.empty())
+            blob_registry.discard(blob);
+        if (admission == DmRouter::NOT_REGISTERED)
+            DmRouter::report(sender, target, DmRouter::OFFLINE);
+        else if (from)
+            refuse_chat(*from, target + "'s mailbox is full");
+        return;
+    }
+
+    log_debug(sender, " → ", target, " : ", message);
+}
+
+// The room's cached roster (see ROOM ROSTERS), sent without holding
+// registry_lock.
+void list_members(const std::string &client_name, const std::string &room)
+{
+    std::shared_ptr<ClientHandle> handle = client_handles.get(client_name);
+    if (!handle)
+        return;
+
+    std::shared_ptr<const Roster> roster = room_rosters.get(room);
+    for (const std::string &message : roster->messages)
+        deliver(*handle, message.c_str(), message.size() + 1);
+}
+
+// Matching messages go back newest first, as many lines per mq message as
+// fit in mq_msgsize, between a "[SEARCH]: n results" header and an end line.
+void search_room(const std::string &client_name, const std::string &room, std::string_view terms)
+{
+    std::shared_ptr<ClientHandle> handle = client_handles.get(client_name);
+    if (!handle)
+        return;
+    if (!message_log.enabled())
+    {
+        send_to_client(client_name, "[SEARCH]: history is off on this server");
+        return;
+    }
+    RoomLog *log = message_log.room(room, false);
+    if (!log)
+    {
+        send_to_client(client_name, "[SEARCH]: no history for #" + room);
+        return;
+    }
+
+    std::vector<std::string> query;
+    for_each_term(terms, [&](const std::string &term)
+                  { if (std::find(query.begin(), query.end(), term) == query.end()) query.push_back(term); });
+
+    auto started = std::chrono::steady_clock::now();
+    std::vector<uint32_t> hits = search_index.search(room, query, server_config.search_limit);
+    record_metric(M_SEARCH, std::chrono::steady_clock::now() - started);
+
+    std::string header = "[SEARCH]: " + std::to_string(hits.size()) + " results for \"" +
+                         std::string(terms) + "\" in #" + room;
+    deliver(*handle, header.c_str(), header.size() + 1);
+
+    std::vector<std::string> lines;
+    for (uint32_t seq : hits)
+        log->read(seq, seq, lines.size() + 1, lines);
+    deliver_lines(*handle, lines);
+
+    const char end_line[] = "[SEARCH]: end";
+    deliver(*handle, end_line, sizeof(end_line));
+}
+
+// The same lines as the [STATS] log and the stats page, between a header
+// and an end line.
+void send_stats(const std::string &client_name)
+{
+    std::shared_ptr<ClientHandle> handle = client_handles.get(client_name);
+    if (!handle)
+        return;
+
+    const char header[] = "[STATS]: server metrics";
+    deliver(*handle, header, sizeof(header));
+    deliver_lines(*handle, stats_lines());
+    const char end_line[] = "[STATS]: end";
+    deliver(*handle, end_line, sizeof(end_line));
+}
+
+// Queue task for the sender's current room, or for room_id if it is one
+// of the sender's rooms. Returns false if it was not queued.
+bool post_to_room(const std::string &sender, BroadcastTask &&task, uint32_t room_id)
+{
+    std::shared_ptr<ClientHandle> handle = client_handles.find(sender);
+    if (handle && !within_rate(*handle))
+        return false;
+
+    {
+        ReadLock lock(registry_lock);
+        const ClientSlot *client = client_directory.entry(sender);
+        if (!client || client->rooms.empty())
+            return false;
+        if (room_id == 0)
+            task.target_room = client->current;
+        else
+        {
+            for (const std::string &room : client->rooms)
+                if (name_id(room) == room_id)
+                    task.target_room = room;
+            if (task.target_room.empty())
+            {
+                log_debug(sender, ": SAY for a room it has left, dropped");
+                return false;
+            }
+        }
+    }
+    task.sender_name = sender;
+    std::string room = task.target_room;
 
-// ============================================================
-//  FUNCTION DECLARATIONS
-// ============================================================
+    if (!room_admits(room))
+    {
+        refused_busy_room.fetch_add(1, std::memory_order_relaxed);
+        if (handle)
+            refuse_chat(*handle, "#" + room + " is busy");
+        return false;
+    }
+    PushResult result = enqueue_broadcast(std::move(task));
+    if (result == PushResult::Rejected && handle)
+        refuse_chat(*handle, "#" + room + " is busy");
+    return result == PushResult::Ok;
+}
 
-void handle_quit(const std::string &msg);
+// line is what members see, e.g. "[alice]: hello". room_id, when not 0,
+// is the room the sender was talking in (binary frames carry it); chat for
+// a room the sender has since left is dropped rather than posted elsewhere.
+void say_to_room(const std::string &sender, Payload line, uint32_t room_id = 0)
+{
+    BroadcastTask task;
+    std::string_view text = line.view();
+    size_t body = text.find("]: ");
+    if (body != std::string_view::npos && accept_blob(sender, text.substr(body + 3), task.blob, task.blob_bytes))
+        task.message_payload = Payload::concat({text.substr(0, body + 3), blob_handle(task.blob, task.blob_bytes)});
+    else
+        task.message_payload = std::move(line);
 
-// ============================================================
-//  HEARTBEAT SYSTEM
-// ============================================================
+    std::string blob = task.blob;
+    if (!post_to_room(sender, std::move(task), room_id) && !blob.empty())
+        blob_registry.discard(blob);
+}
 
-void handle_ping(const std::string &msg)
+// An empty room leaves every room the client is in.
+void leave_room(const std::string &client_name, const std::string &room = "")
 {
-    std::string client_name = msg.substr(5);
-    std::lock_guard<std::mutex> lock(heartbeat_mutex);
-    client_heartbeats[client_name] = std::chrono::steady_clock::now();
+    std::vector<std::string> left;
+    {
+        WriteLock lock(registry_lock);
+        if (room.empty())
+            left = remove_from_all_rooms(client_name);
+        else if (remove_from_room(client_name, room))
+            left.push_back(room);
+    }
+
+    for (const std::string &r : left)
+    {
+        BroadcastTask task;
+        task.message_payload = Payload::concat({"[SYSTEM]: ", client_name, " has left #", r});
+        task.sender_name = client_name;
+        task.target_room = r;
+        task.priority = PRIO_CONTROL;
+        enqueue_broadcast(std::move(task));
+    }
 }
 
-void heartbeat_cleaner()
+void quit_client(const std::string &client_name)
 {
-    while (true)
-    {
-        std::this_thread::sleep_for(std::chrono::seconds(3000));
+    std::vector<std::string> rooms_left;
 
-        std::vector<std::string> dead_clients;
-        auto now = std::chrono::steady_clock::now();
-        const int TIMEOUT_SECONDS = 600000000;
+    {
+        WriteLock lock(registry_lock);
+        rooms_left = remove_from_all_rooms(client_name);
+        client_directory.release(client_name);
+        if (client_queues.count("/client_" + client_name))
+            dm_router.offline(client_name);
+        client_queues.erase("/client_" + client_name);
 
-        {
-            std::lock_guard<std::mutex> lock(heartbeat_mutex);
-            for (const auto &pair : client_heartbeats)
-            {
-                auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - pair.second).count();
-                if (elapsed > TIMEOUT_SECONDS)
-                    dead_clients.push_back(pair.first);
-            }
-        }
+        auto it = client_ids.find(name_id(client_name));
+        if (it != client_ids.end() && it->second == client_name)
+            client_ids.erase(it);
+    }
 
-        for (const std::string &client_name : dead_clients)
-        {
-            std::cout << "[SYSTEM] Heartbeat timeout for " << client_name << ". Cleaning up." << std::endl;
-            handle_quit("QUIT:" + client_name);
+    client_handles.invalidate(client_name);
+    blob_registry.release_all(client_name);
+    log_info(client_name, " has quit the server.");
 
-            mqd_t server_q = mq_open("/server", O_WRONLY | O_NONBLOCK);
-            if (server_q != -1)
-            {
-                std::string quit_msg = "QUIT:" + client_name;
-                mq_send(server_q, quit_msg.c_str(), quit_msg.size() + 1, 0);
-                mq_close(server_q);
-            }
-        }
+    for (const std::string &room : rooms_left)
+    {
+        BroadcastTask quit_task;
+        quit_task.sender_name = client_name;
+        quit_task.message_payload = Payload::concat({"[SYSTEM]: ", client_name, " has quit"});
+        quit_task.target_room = room;
+        quit_task.priority = PRIO_CONTROL;
+        enqueue_broadcast(std::move(quit_task));
     }
 }
 
 // ============================================================
-//  HANDLER FUNCTIONS
+//  TEXT PROTOCOL PARSERS
 // ============================================================
+//
+// msg views the receive buffer directly; arguments are only copied into
+// std::string where they become registry keys.
 
-void handle_register(const std::string &msg)
+bool has_prefix(std::string_view msg, std::string_view prefix)
 {
-    std::string qname = msg.substr(9);
+    return msg.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Split "<name>;caps=<bits>;overflow=<policy>" into the name and its options.
+std::string_view parse_register_options(std::string_view text, uint32_t &caps, ClientOverflow &overflow)
+{
+    size_t end = text.find(';');
+    std::string_view name = text.substr(0, end);
+
+    while (end != std::string_view::npos)
     {
-        WriteLock lock(registry_lock);
-        client_queues.push_back(qname);
+        size_t next = text.find(';', end + 1);
+        std::string_view option = text.substr(end + 1, next == std::string_view::npos ? std::string_view::npos : next - end - 1);
+        if (has_prefix(option, "caps="))
+            caps |= static_cast<uint32_t>(std::strtoul(std::string(option.substr(5)).c_str(), nullptr, 10));
+        else if (has_prefix(option, "overflow="))
+            parse_client_overflow(std::string(option.substr(9)), overflow);
+        end = next;
     }
+    return name;
+}
+
+// Split "<room>;last=<n>" / "<room>;since=<seq>" into the room and the
+// backlog it asks for.
+std::string_view parse_join_options(std::string_view text, BacklogRequest &backlog)
+{
+    size_t end = text.find(';');
+    std::string_view room = text.substr(0, end);
 
-    std::string client_name = qname.substr(8);
+    while (end != std::string_view::npos)
     {
-        std::lock_guard<std::mutex> lock(heartbeat_mutex);
-        client_heartbeats[client_name] = std::chrono::steady_clock::now();
+        size_t next = text.find(';', end + 1);
+        std::string_view option = text.substr(end + 1, next == std::string_view::npos ? std::string_view::npos : next - end - 1);
+        if (has_prefix(option, "last="))
+            backlog.last = std::max(0, std::atoi(std::string(option.substr(5)).c_str()));
+        else if (has_prefix(option, "since="))
+            backlog.since = std::max(0, std::atoi(std::string(option.substr(6)).c_str()));
+        end = next;
     }
-    std::cout << qname << " has joined the server!" << std::endl;
+    return room;
 }
 
-void handle_join(const std::string &msg)
+void handle_register(std::string_view msg)
 {
-    WriteLock lock(registry_lock);
+    // REGISTER:/client_<name>[;caps=<bits>][;overflow=<policy>]
+    uint32_t caps = 0;
+    ClientOverflow overflow = server_config.client_overflow;
+    std::string_view qname = parse_register_options(msg.substr(9), caps, overflow);
 
-    std::string payload = msg.substr(5);
+    if (!has_prefix(qname, "/client_"))
+        return;
+    register_client(std::string(qname.substr(8)), caps, overflow);
+}
+
+void handle_join(std::string_view msg)
+{
+    std::string_view payload = msg.substr(5);
     size_t pos = payload.find(':');
-    if (pos == std::string::npos)
+    if (pos == std::string_view::npos || pos + 2 > payload.size())
         return;
 
-    std::string name = payload.substr(0, pos);
-    std::string room = payload.substr(pos + 2);
+    // JOIN:<name>: <room>[;last=<n>][;since=<seq>]
+    BacklogRequest backlog;
+    std::string_view room = parse_join_options(payload.substr(pos + 2), backlog);
+    if (room.empty())
+        return;
 
-    if (!room_members.count(room))
-        room_members[room] = {};
+    std::string name(payload.substr(0, pos));
+    touch_heartbeat(name);
+    join_room(name, std::string(room), backlog);
+}
 
-    for (auto &pair : room_members)
-    {
-        auto &members = pair.second;
-        members.erase(std::remove(members.begin(), members.end(), name), members.end());
-    }
+void handle_dm(std::string_view msg)
+{
+    size_t first = msg.find(':', 3);
+    if (first == std::string_view::npos)
+        return;
 
-    room_members[room].push_back(name);
+    size_t second = msg.find(':', first + 1);
+    if (second == std::string_view::npos)
+        return;
 
-    BroadcastTask task;
-    task.sequence_id = ++global_sequence_id; // Use pre-increment to ensure atomic increment and fetch
-    task.message_payload = "[SEQ:" + std::to_string(task.sequence_id) + "] [SYSTEM]: " + name + " has joined #" + room;
-    task.sender_name = name;
-    task.target_room = room;
-    broadcast_queue.push(task);
+    std::string sender(msg.substr(3, first - 3));
+    std::string target(msg.substr(first + 1, second - first - 1));
+    touch_heartbeat(sender);
+    send_dm(sender, target, msg.substr(second + 1));
 }
 
-void handle_dm(const std::string &msg)
+void handle_who(std::string_view msg)
 {
-    ReadLock lock(registry_lock);
-    size_t first = msg.find(':', 3);
-    if (first == std::string::npos)
+    size_t name_start = 4;
+    size_t end = msg.find('>', name_start);
+    if (end == std::string_view::npos)
         return;
 
-    std::string rest = msg.substr(first + 1);
-    size_t second = rest.find(':');
-    if (second == std::string::npos)
-        return;
+    std::string name(msg.substr(name_start, end - name_start));
+    touch_heartbeat(name);
+    list_members(name, std::string(msg.substr(end + 1)));
+}
 
-    std::string sender = msg.substr(3, first - 3);
-    std::string target = rest.substr(0, second);
-    std::string message = rest.substr(second + 1);
+void handle_search(std::string_view msg)
+{
+    // SEARCH:<name>:<room>:<terms>
+    std::string_view rest = msg.substr(7);
+    size_t name_end = rest.find(':');
+    if (name_end == std::string_view::npos)
+        return;
+    size_t room_end = rest.find(':', name_end + 1);
+    if (room_end == std::string_view::npos)
+        return;
 
-    std::string qname = "/client_" + target;
-    mqd_t client_q = mq_open(qname.c_str(), O_WRONLY);
+    std::string name(rest.substr(0, name_end));
+    touch_heartbeat(name);
+    search_room(name, std::string(rest.substr(name_end + 1, room_end - name_end - 1)), rest.substr(room_end + 1));
+}
 
-    if (client_q == -1)
-    {
-        std::string fail = "[Server]: user '" + target + "' not found.";
-        std::string sender_q = "/client_" + sender;
-        mqd_t s_q = mq_open(sender_q.c_str(), O_WRONLY);
-        if (s_q != -1)
-        {
-            mq_send(s_q, fail.c_str(), fail.size() + 1, 0);
-            mq_close(s_q);
-        }
+void handle_say(std::string_view msg)
+{
+    std::string_view payload = msg.substr(4);
+    size_t start = payload.find('[');
+    size_t end = payload.find(']');
+    if (start == std::string_view::npos || end == std::string_view::npos || end < start)
         return;
-    }
 
-    std::string full_msg = "[DM from " + sender + "]: " + message;
-    mq_send(client_q, full_msg.c_str(), full_msg.size() + 1, 0);
-    mq_close(client_q);
+    std::string sender(payload.substr(start + 1, end - start - 1));
+    touch_heartbeat(sender);
+    say_to_room(sender, Payload::concat({payload}));
+}
+
+void handle_leave(std::string_view msg)
+{
+    // LEAVE:<name>[:<room>]
+    std::string_view rest = msg.substr(6);
+    size_t colon = rest.find(':');
+    std::string name(rest.substr(0, colon));
+    touch_heartbeat(name);
+    leave_room(name, colon == std::string_view::npos ? std::string() : std::string(rest.substr(colon + 1)));
+}
+
+void handle_quit(std::string_view msg)
+{
+    // QUIT:<name> or QUIT:<name>:<mode>; the mode is informational only
+    std::string_view rest = msg.substr(5);
+    size_t colon = rest.find(':');
+    quit_client(std::string(rest.substr(0, colon)));
+}
 
-    std::cout << sender << " → " << target << " : " << message << std::endl;
+void handle_ping(std::string_view msg)
+{
+    touch_heartbeat(std::string(msg.substr(5)));
 }
 
-void handle_who(const std::string &msg)
+void handle_stats(std::string_view msg)
 {
-    ReadLock lock(registry_lock);
+    // STATS:<name>
+    std::string name(msg.substr(6));
+    touch_heartbeat(name);
+    send_stats(name);
+}
 
-    size_t name_start = 4;
-    size_t end = msg.find('>', name_start);
-    if (end == std::string::npos)
+void handle_release(std::string_view msg)
+{
+    // RELEASE:<name>:<object>
+    std::string_view rest = msg.substr(8);
+    size_t colon = rest.find(':');
+    if (colon == std::string_view::npos)
         return;
+    std::string name(rest.substr(0, colon));
+    touch_heartbeat(name);
+    blob_registry.release(std::string(rest.substr(colon + 1)), name);
+}
+
+void handle_unknown(std::string_view msg)
+{
+    log_warn("Unknown message: ", msg);
+}
 
-    std::string client_name = msg.substr(name_start, end - name_start);
-    std::string room = msg.substr(end + 1);
+struct TextCommand
+{
+    std::string_view prefix;
+    Opcode op; // the frame opcode of the same command, for handler metrics
+    void (*handler)(std::string_view);
+};
+
+const TextCommand text_commands[] = {
+    {"REGISTER:", OP_REGISTER, handle_register},
+    {"JOIN:", OP_JOIN, handle_join},
+    {"SAY:", OP_SAY, handle_say},
+    {"DM:", OP_DM, handle_dm},
+    {"WHO:", OP_WHO, handle_who},
+    {"LEAVE:", OP_LEAVE, handle_leave},
+    {"QUIT:", OP_QUIT, handle_quit},
+    {"PING:", OP_PING, handle_ping},
+    {"SEARCH:", OP_SEARCH, handle_search},
+    {"STATS:", OP_STATS, handle_stats},
+    {"RELEASE:", OP_RELEASE, handle_release},
+};
 
-    std::string payload = "[Members in #" + room + "]: ";
+// Run one handler and record how long it took under its opcode.
+template <typename Handler, typename Arg>
+void run_timed(int op, Handler handler, const Arg &arg)
+{
+    auto started = std::chrono::steady_clock::now();
+    handler(arg);
+    record_metric(static_cast<Metric>(M_HANDLER + op), std::chrono::steady_clock::now() - started);
+}
 
-    if (room_members.count(room) && !room_members[room].empty())
+const TextCommand *find_text_command(std::string_view msg)
+{
+    for (const TextCommand &command : text_commands)
     {
-        for (size_t i = 0; i < room_members[room].size(); ++i)
-        {
-            payload += room_members[room][i];
-            if (i < room_members[room].size() - 1)
-                payload += ", ";
-        }
+        if (has_prefix(msg, command.prefix))
+            return &command;
     }
+    return nullptr;
+}
+
+void dispatch_text(std::string_view msg)
+{
+    if (const TextCommand *command = find_text_command(msg))
+        run_timed(command->op, command->handler, msg);
     else
+        run_timed(0, handle_unknown, msg);
+}
+
+// ============================================================
+//  BINARY PROTOCOL HANDLERS
+// ============================================================
+
+// Resolve a frame's sender id and mark the sender alive. Returns false for
+// unregistered senders.
+bool frame_sender(const Frame &frame, std::string &name)
+{
     {
-        payload += "(empty)";
+        ReadLock lock(registry_lock);
+        auto it = client_ids.find(frame.header.sender_id);
+        if (it == client_ids.end())
+            return false;
+        name = it->second;
     }
+    touch_heartbeat(name);
+    return true;
+}
 
-    std::string qname = "/client_" + client_name;
-    mqd_t client_q = mq_open(qname.c_str(), O_WRONLY);
-    if (client_q == -1)
+void frame_register(const Frame &frame)
+{
+    uint32_t caps = frame.header.room_id; // room_id carries ClientCaps
+    ClientOverflow overflow = server_config.client_overflow;
+    std::string_view name = parse_register_options(frame.payload, caps, overflow);
+
+    if (name.empty() || name_id(name) != frame.header.sender_id)
         return;
+    register_client(std::string(name), caps, overflow);
+}
 
-    mq_send(client_q, payload.c_str(), payload.size() + 1, 0);
-    mq_close(client_q);
+void frame_join(const Frame &frame)
+{
+    std::string name;
+    BacklogRequest backlog;
+    std::string_view room = parse_join_options(frame.payload, backlog);
+    if (room.empty() || !frame_sender(frame, name))
+        return;
+    join_room(name, std::string(room), backlog);
 }
 
-void handle_say(const std::string &msg)
+void frame_say(const Frame &frame)
 {
-    std::string payload = msg.substr(4);
-    size_t start = payload.find('[');
-    size_t end = payload.find(']');
-    std::string sender = payload.substr(start + 1, end - start - 1);
+    std::string name;
+    if (!frame_sender(frame, name))
+        return;
 
-    BroadcastTask task;
-    task.sequence_id = ++global_sequence_id; // Use pre-increment to ensure atomic increment and fetch
-    task.message_payload = "[SEQ:" + std::to_string(task.sequence_id) + "] " + payload;
-    task.sender_name = sender;
-    task.target_room = "";
-    broadcast_queue.push(task);
+    say_to_room(name, Payload::concat({"[", name, "]: ", frame.payload}), frame.header.room_id);
+}
+
+void frame_dm(const Frame &frame)
+{
+    std::string name;
+    size_t colon = frame.payload.find(':');
+    if (colon == std::string_view::npos || !frame_sender(frame, name))
+        return;
+    send_dm(name, std::string(frame.payload.substr(0, colon)), frame.payload.substr(colon + 1));
 }
 
-void handle_leave(const std::string &msg)
+void frame_who(const Frame &frame)
 {
-    std::string client_name = msg.substr(6);
-    WriteLock lock(registry_lock);
+    std::string name;
+    if (!frame_sender(frame, name))
+        return;
 
-    for (auto &pair : room_members)
+    std::string room(frame.payload);
+    if (room.empty())
     {
-        auto &members = pair.second;
-        auto it = std::remove(members.begin(), members.end(), client_name);
-        if (it != members.end())
-        {
-            members.erase(it, members.end());
-
-            BroadcastTask task;
-            task.sequence_id = ++global_sequence_id; // Use pre-increment to ensure atomic increment and fetch
-            task.message_payload = "[SEQ:" + std::to_string(task.sequence_id) + "] [SYSTEM]: " + client_name + " has left #" + pair.first;
-            task.sender_name = client_name;
-            task.target_room = pair.first;
-            broadcast_queue.push(task);
-            break;
-        }
+        ReadLock lock(registry_lock);
+        auto it = room_ids.find(frame.header.room_id);
+        if (it != room_ids.end())
+            room = it->second;
     }
+    list_members(name, room);
+}
+
+void frame_search(const Frame &frame)
+{
+    std::string name;
+    size_t colon = frame.payload.find(':');
+    if (colon == std::string_view::npos || !frame_sender(frame, name))
+        return;
+    search_room(name, std::string(frame.payload.substr(0, colon)), frame.payload.substr(colon + 1));
+}
+
+void frame_leave(const Frame &frame)
+{
+    std::string name;
+    if (frame_sender(frame, name))
+        leave_room(name, std::string(frame.payload));
 }
 
-void handle_quit(const std::string &msg)
+void frame_quit(const Frame &frame)
 {
-    std::string rest = msg.substr(5);
-    std::string client_name;
-    std::string mode;
+    std::string name;
+    if (frame_sender(frame, name))
+        quit_client(name);
+}
 
-    size_t colon = rest.find(':');
-    if (colon == std::string::npos)
+void frame_ping(const Frame &frame)
+{
+    std::string name;
+    frame_sender(frame, name); // marks the sender alive
+}
+
+void frame_stats(const Frame &frame)
+{
+    std::string name;
+    if (frame_sender(frame, name))
+        send_stats(name);
+}
+
+void frame_release(const Frame &frame)
+{
+    std::string name;
+    if (frame_sender(frame, name))
+        blob_registry.release(std::string(frame.payload), name);
+}
+
+using FrameHandler = void (*)(const Frame &);
+
+const FrameHandler frame_handlers[OP_COUNT] = {
+    nullptr,        // 0 is never a valid opcode
+    frame_register, // OP_REGISTER
+    frame_join,     // OP_JOIN
+    frame_say,      // OP_SAY
+    frame_dm,       // OP_DM
+    frame_who,      // OP_WHO
+    frame_leave,    // OP_LEAVE
+    frame_quit,     // OP_QUIT
+    frame_ping,     // OP_PING
+    frame_search,   // OP_SEARCH
+    frame_stats,    // OP_STATS
+    frame_release,  // OP_RELEASE
+};
+
+// Route one received message. buf/n is exactly what mq_receive returned.
+void dispatch_message(const char *buf, size_t n)
+{
+    if (is_batch(buf, n))
     {
-        client_name = rest;
-        mode = "quit";
+        // records are full commands; nested batches are not allowed
+        bool ok = for_each_batch_record(buf, n, [](std::string_view record)
+                                        {
+            if (!is_batch(record.data(), record.size()))
+                dispatch_message(record.data(), record.size()); });
+        if (!ok)
+            log_warn("Malformed batch (", n, " bytes)");
+        return;
     }
-    else
+
+    Frame frame;
+    if (decode_frame(buf, n, frame))
     {
-        client_name = rest.substr(0, colon);
-        mode = rest.substr(colon + 1);
+        run_timed(frame.header.opcode, frame_handlers[frame.header.opcode], frame);
+        return;
+    }
+
+    if (is_binary_frame(buf, n))
+    {
+        log_warn("Malformed frame (", n, " bytes)");
+        return;
     }
 
-    std::string room_left;
+    // text commands are sent with their terminating NUL
+    dispatch_text(std::string_view(buf, strnlen(buf, n)));
+}
+
+// ============================================================
+//  CAPTURE WRITER
+// ============================================================
+
+// Who sent a received message, as the replayer needs it to recreate the
+// client; empty if it can't be told (e.g. a frame from a client that has
+// quit since). A batch is named after its first record.
+std::string message_sender(std::string_view message)
+{
+    uint32_t caps = 0;
+    ClientOverflow overflow = server_config.client_overflow;
 
+    if (is_batch(message.data(), message.size()))
     {
-        WriteLock lock(registry_lock);
-        for (auto &pair : room_members)
-        {
-            auto &members = pair.second;
-            auto it = std::remove(members.begin(), members.end(), client_name);
+        std::string sender;
+        for_each_batch_record(message.data(), message.size(), [&](std::string_view record)
+                              {
+            if (sender.empty() && !is_batch(record.data(), record.size()))
+                sender = message_sender(record); });
+        return sender;
+    }
 
-            if (it != members.end())
-            {
-                members.erase(it, members.end());
-                room_left = pair.first;
-                break;
-            }
-        }
-        std::string qname = "/client_" + client_name;
-        client_queues.erase(std::remove(client_queues.begin(), client_queues.end(), qname), client_queues.end());
+    Frame frame;
+    if (decode_frame(message.data(), message.size(), frame))
+    {
+        if (frame.header.opcode == OP_REGISTER)
+            return std::string(parse_register_options(frame.payload, caps, overflow));
+        ReadLock lock(registry_lock);
+        auto it = client_ids.find(frame.header.sender_id);
+        return it == client_ids.end() ? std::string() : it->second;
     }
 
-    std::cout << client_name << " has quit the server." << std::endl;
+    std::string_view text(message.data(), strnlen(message.data(), message.size()));
+    const TextCommand *command = find_text_command(text);
+    if (!command)
+        return std::string();
+    std::string_view rest = text.substr(command->prefix.size());
 
-    if (!room_left.empty())
+    switch (command->op)
     {
-        BroadcastTask quit_task;
-        quit_task.sequence_id = ++global_sequence_id; // Use pre-increment to ensure atomic increment and fetch
-        quit_task.sender_name = client_name;
-        quit_task.message_payload = "[SEQ:" + std::to_string(quit_task.sequence_id) + "] [SYSTEM]: " + client_name + " has quit";
-        quit_task.target_room = room_left;
-        broadcast_queue.push(quit_task);
+    case OP_REGISTER:
+    {
+        std::string_view qname = parse_register_options(rest, caps, overflow);
+        return has_prefix(qname, "/client_") ? std::string(qname.substr(8)) : std::string();
     }
+    case OP_SAY:
+    {
+        size_t start = rest.find('[');
+        size_t end = rest.find(']');
+        if (start == std::string_view::npos || end == std::string_view::npos || end < start)
+            return std::string();
+        return std::string(rest.substr(start + 1, end - start - 1));
+    }
+    default:
+        // JOIN:<name>: ..., DM:<name>:..., WHO:<name>>..., QUIT:<name>[:mode], PING:<name>, ...
+        return std::string(rest.substr(0, rest.find_first_of(":>")));
+    }
+}
 
-    std::lock_guard<std::mutex> lock(heartbeat_mutex);
-    client_heartbeats.erase(client_name);
+void TrafficCapture::writer()
+{
+    std::vector<CapturedMessage> batch;
+    while (true)
+    {
+        batch.clear();
+        queue->pop_batch(batch, 256);
+        for (const CapturedMessage &message : batch)
+        {
+            std::string sender = message_sender(message.bytes);
+            CaptureRecordHeader header{};
+            header.offset_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(message.received - started).count();
+            header.sender_len = static_cast<uint16_t>(std::min<size_t>(sender.size(), UINT16_MAX));
+            header.length = static_cast<uint32_t>(message.bytes.size());
+            std::fwrite(&header, sizeof(header), 1, out);
+            std::fwrite(sender.data(), 1, header.sender_len, out);
+            std::fwrite(message.bytes.data(), 1, message.bytes.size(), out);
+        }
+        // flushed per batch so a killed server leaves a usable file
+        std::fflush(out);
+        written_count.fetch_add(batch.size(), std::memory_order_relaxed);
+    }
 }
 
 // ============================================================
-//  BROADCASTER WORKER
+//  INGEST RECEIVERS
 // ============================================================
+//
+// Every ingest queue has its own receiver thread that runs the handlers
+// directly, so handlers must be safe to run concurrently: shared state is
+// only touched under registry_lock or inside the
+// thread-safe ClientQueueCache / TaskQueue.
 
-void broadcaster_worker()
+void ingest_receiver(mqd_t server_q)
 {
-    std::cout << "Broadcaster thread " << std::this_thread::get_id() << " started." << std::endl;
-
-    while (true)
+    std::vector<char> buf(server_config.mq_msgsize);
+    while (!shutdown_requested)
     {
-        BroadcastTask task = broadcast_queue.pop();
-        std::string room_to_broadcast;
-
-        if (!task.target_room.empty())
-        {
-            room_to_broadcast = task.target_room;
-        }
-        else
+        ssize_t n = mq_receive(server_q, buf.data(), buf.size(), nullptr);
+        if (n > 0 && !shutdown_requested) // the wake-up sent at shutdown is not a command
         {
-            ReadLock lock(registry_lock);
-            for (const auto &pair : room_members)
-            {
-                const auto &members = pair.second;
-                if (std::find(members.begin(), members.end(), task.sender_name) != members.end())
-                {
-                    room_to_broadcast = pair.first;
-                    break;
-                }
-            }
+            if (traffic_capture.enabled())
+                traffic_capture.record(buf.data(), n);
+            dispatch_message(buf.data(), n);
         }
+    }
+}
 
-        if (room_to_broadcast.empty())
-            continue;
-
-        ReadLock lock(registry_lock);
-        for (const auto &member : room_members.at(room_to_broadcast))
-        {
-            if (member == task.sender_name)
-                 continue;
+// Open (creating if needed) a server queue with the configured geometry.
+// An existing queue with a different geometry is recreated, since clients
+// size their buffers from the server queue's attributes.
+mqd_t open_server_queue(const std::string &qname)
+{
+    struct mq_attr attr;
+    attr.mq_flags = 0;
+    attr.mq_maxmsg = server_config.mq_maxmsg;
+    attr.mq_msgsize = server_config.mq_msgsize;
+    attr.mq_curmsgs = 0;
 
-            std::string qname = "/client_" + member;
-            mqd_t client_q = mq_open(qname.c_str(), O_WRONLY | O_NONBLOCK);
+    mqd_t q = mq_open(qname.c_str(), O_CREAT | O_RDWR, 0644, &attr);
+    if (q == -1)
+        return q;
 
-            if (client_q != -1)
-            {
-                mq_send(client_q, task.message_payload.c_str(), task.message_payload.size() + 1, 0);
-                mq_close(client_q);
-            }
-        }
+    struct mq_attr actual;
+    if (mq_getattr(q, &actual) == 0 &&
+        (actual.mq_maxmsg != attr.mq_maxmsg || actual.mq_msgsize != attr.mq_msgsize))
+    {
+        log_info("[CONFIG] ", qname, " had maxmsg=", actual.mq_maxmsg, " msgsize=", actual.mq_msgsize,
+                 ", recreating it.");
+        mq_close(q);
+        mq_unlink(qname.c_str());
+        q = mq_open(qname.c_str(), O_CREAT | O_RDWR, 0644, &attr);
     }
+    return q;
 }
 
 // ============================================================
 //  MAIN FUNCTION
 // ============================================================
 
-int main()
+// bench.cpp includes this file with CHAT_NO_MAIN to benchmark the pieces above.
+#ifndef CHAT_NO_MAIN
+void request_shutdown(int)
 {
+    shutdown_requested = true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (!parse_server_args(argc, argv, server_config))
+    {
+        std::cerr << "+++++ USAGE: ./server [--config FILE] [--mq-maxmsg N] [--mq-msgsize N]"
+                  << " [--client-overflow spill|drop-newest|drop-oldest] [--spill-limit N]"
+                  << " [--queue-capacity N] [--queue-policy block|drop|reject]"
+                  << " [--broadcast-batch N] [--broadcast-workers N] [--broadcast-min-workers N]"
+                  << " [--pin-broadcasters 0|1] [--ingest-queues N]"
+                  << " [--batch-linger-us N] [--batch-bytes N]"
+                  << " [--heartbeat-timeout S] [--heartbeat-sweep-ms N] [--stats-interval S] [--stats-page-ms N]"
+                  << " [--log-level error|warn|info|debug]"
+                  << " [--log-dir DIR] [--log-segment-mb N] [--log-fsync-ms N] [--search-limit N]"
+                  << " [--rate-limit N] [--rate-burst N] [--admit-depth N]"
+                  << " [--dm-mailbox N] [--dm-hold-ms N] [--blob-ttl S] [--capture FILE] +++++" << std::endl;
+        return 1;
+    }
+    // SIGINT and SIGTERM stop the server cleanly. They stay blocked in every
+    // other thread, so they always interrupt the main thread's mq_receive.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+    logger.start(server_config.log_level);
+    clamp_to_kernel_limits(server_config);
+    client_handles.default_overflow = server_config.client_overflow;
+
     // initial for locking
-    pthread_rwlock_init(&registry_lock, NULL);
+    init_registry_lock();
+
+    if (!message_log.start(server_config.log_dir))
+    {
+        perror(("mkdir " + server_config.log_dir).c_str());
+        return 1;
+    }
+    backlog_replayer.start();
+    dm_router.start();
+    if (message_log.enabled())
+    {
+        search_index.start();
+        log_info("Message log in ", server_config.log_dir, ".");
+    }
+    if (!traffic_capture.start(server_config.capture_path))
+    {
+        perror(("fopen " + server_config.capture_path).c_str());
+        return 1;
+    }
+    if (traffic_capture.enabled())
+        log_info("Capturing inbound traffic to ", server_config.capture_path, ".");
 
     // Create broadcaster pool
-    int num_broadcasters = 16; // initial thread number of workers
-    for (int i = 0; i < num_broadcasters; ++i)
-        std::thread(broadcaster_worker).detach();
-    std::cout << "Broadcaster pool (size=" << num_broadcasters << ") started." << std::endl;
+    for (int i = 0; i < NUM_BROADCAST_SHARDS; ++i)
+        broadcast_shards[i].reset(new BroadcastShard(server_config.queue_capacity, server_config.queue_policy));
+    broadcaster_pool.start(server_config.broadcast_min_workers, server_config.broadcast_workers,
+                           server_config.pin_broadcasters);
+    log_info("Broadcaster pool (size=", broadcaster_pool.size(), ", min=", broadcaster_pool.min(),
+             ", max=", broadcaster_pool.max(), ", shards=", NUM_BROADCAST_SHARDS, ") started.");
 
     // Start heartbeat cleaner thread
+    heartbeat_wheel.configure(server_config.heartbeat_sweep_ms, server_config.heartbeat_timeout_s * 1000LL);
     std::thread(heartbeat_cleaner).detach();
-    std::cout << "Heartbeat cleaner thread started." << std::endl;
+    std::thread(stats_reporter).detach();
+    if (server_config.stats_page_ms > 0)
+        std::thread(stats_publisher).detach();
+    if (server_config.blob_ttl_s > 0)
+        std::thread(blob_sweeper).detach();
+    log_info("Heartbeat cleaner thread started.");
 
-    // Server message queue setup
-    struct mq_attr attr;
-    attr.mq_flags = 0;
-    attr.mq_maxmsg = 10;
-    attr.mq_msgsize = 1024;
-    attr.mq_curmsgs = 0;
+    if (!egress_reactor.start())
+    {
+        perror("epoll_create1");
+        return 1;
+    }
 
     // open server message queue
-    mqd_t server_q = mq_open("/server", O_CREAT | O_RDWR, 0644, &attr);
+    mqd_t server_q = open_server_queue("/server");
     if (server_q == -1)
     {
         perror("mq_open not complete");
         return 1;
     }
-    std::cout << "Server opened." << std::endl;
+    log_info("Server opened.");
 
-    // while loop listen for client queue
-    char buf[1024];
-    while (true)
+    // Clients pick a shard by counting the /server_<i> queues that exist,
+    // so remove any left over from a run with more shards first.
+    for (int i = 0; i < MAX_INGEST_QUEUES; ++i)
+        mq_unlink(ingest_queue_name(i).c_str());
+
+    std::vector<mqd_t> shard_queues;
+    std::vector<std::thread> shard_receivers;
+    if (server_config.ingest_queues > 1)
     {
-        ssize_t n = mq_receive(server_q, buf, sizeof(buf), nullptr);
-        if (n > 0)
-        {
-            buf[n] = '\0';
-            std::string msg(buf);
-
-            if (msg.rfind("REGISTER:", 0) == 0)
-                handle_register(msg);
-            else if (msg.rfind("JOIN:", 0) == 0)
-                handle_join(msg);
-            else if (msg.rfind("SAY:", 0) == 0)
-                handle_say(msg);
-            else if (msg.rfind("DM:", 0) == 0)
-                handle_dm(msg);
-            else if (msg.rfind("WHO:", 0) == 0)
-                handle_who(msg);
-            else if (msg.rfind("LEAVE:", 0) == 0)
-                handle_leave(msg);
-            else if (msg.rfind("QUIT:", 0) == 0)
-                handle_quit(msg);
-            else if (msg.rfind("PING:", 0) == 0)
-                handle_ping(msg);
-            else
-                std::cout << "Unknown message: " << msg << std::endl;
+        for (int i = 0; i < server_config.ingest_queues; ++i)
+        {
+            std::string qname = ingest_queue_name(i);
+            mqd_t shard_q = open_server_queue(qname);
+            if (shard_q == -1)
+            {
+                perror(("mq_open " + qname).c_str());
+                return 1;
+            }
+            shard_queues.push_back(shard_q);
+            shard_receivers.emplace_back(ingest_receiver, shard_q);
         }
+        log_info("Ingest queues (count=", server_config.ingest_queues, ") opened.");
     }
 
+    struct sigaction stop_action = {};
+    stop_action.sa_handler = request_shutdown; // no SA_RESTART: mq_receive returns EINTR
+    sigaction(SIGINT, &stop_action, nullptr);
+    sigaction(SIGTERM, &stop_action, nullptr);
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, nullptr);
+
+    // /server stays open for legacy clients and the load tester
+    ingest_receiver(server_q);
+
+    // Stop the other receivers before the pool, or they would keep queueing
+    // broadcasts that nothing drains. The signal only interrupts this thread,
+    // so each one is woken with an empty message; if its queue is full it is
+    // about to wake anyway.
+    log_info("Shutting down: finishing queued broadcasts.");
+    for (mqd_t shard_q : shard_queues)
+    {
+        struct mq_attr nonblocking = {};
+        nonblocking.mq_flags = O_NONBLOCK;
+        mq_setattr(shard_q, &nonblocking, nullptr);
+        mq_send(shard_q, "", 1, PRIO_CONTROL);
+    }
+    for (std::thread &receiver : shard_receivers)
+        receiver.join();
+    broadcaster_pool.stop();
+    blob_registry.clear();
     mq_close(server_q);
     mq_unlink("/server");
-    return 0;
+    for (size_t i = 0; i < shard_queues.size(); ++i)
+    {
+        mq_close(shard_queues[i]);
+        mq_unlink(ingest_queue_name(i).c_str());
+    }
+    shm_unlink(STATS_PAGE_NAME);
+    log_info("Server stopped.");
+    logger.drain();
+
+    // The detached threads (logger, heartbeat, reactor, ...) are still
+    // parked on condition variables of globals, and destroying those would
+    // wait for them forever: leave without running static destructors.
+    std::fflush(stdout);
+    std::_Exit(0);
 }
+#endif